@@ -4,27 +4,192 @@
  * Implementations of allocator functions.
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 
 #include "allocator.h"
 #include "logger.h"
-
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#include "perf.h"
 
 #define ALIGNMENT 16
 
-struct mem_block *blist_head = NULL;
-struct mem_block *blist_tail = NULL;
-
-struct free_block *free_head = NULL;
-struct free_block *free_tail = NULL;
+/* Flags kept in the low (alignment) bits of mem_block.size */
+#define BLOCK_FREE      0x01
+#define BLOCK_DEDICATED 0x02
+#define BLOCK_GROWN     0x04
+#define BLOCK_PARKED    0x08 /* freed, but held by a thread cache or remote stack */
+#define BLOCK_FLAGS     (ALIGNMENT - 1)
+
+/* Regular arenas first, then the latency-critical ones */
+#define ARENA_SLOTS (ALLOC_MAX_ARENAS + ALLOC_MAX_CRITICAL_ARENAS)
+static struct arena arenas[ARENA_SLOTS] = {
+    [0 ... ARENA_SLOTS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+/* Number of arenas new threads are spread across (0 until first use) */
+static _Atomic size_t arena_limit = 0;
+/* Number of arenas that have ever been handed to a thread */
+static _Atomic size_t arena_count = 0;
+static atomic_uint next_arena = 0;
+/* Number of latency-critical arenas claimed so far */
+static _Atomic size_t critical_count = 0;
+
+static __thread struct arena *my_arena
+    __attribute__((tls_model("initial-exec"))) = NULL;
+/* Regular arena a latency-critical thread allocates from once its reserve is
+ * exhausted, picked the first time that happens */
+static __thread struct arena *my_fallback_arena
+    __attribute__((tls_model("initial-exec"))) = NULL;
+
+/*
+ * Usable bytes of every block the thread has allocated and freed, see
+ * allocator_thread_allocatedp().
+ */
+static __thread uint64_t thread_allocated
+    __attribute__((tls_model("initial-exec"))) = 0;
+static __thread uint64_t thread_deallocated
+    __attribute__((tls_model("initial-exec"))) = 0;
+
+/*
+ * Allocation contexts (tenants). A block records the context that was current
+ * on its thread when it was allocated in the two bytes past its name, so
+ * free_impl() credits the same context whichever thread frees it. Context 0 is
+ * the default and isn't tracked, keeping untagged allocations off the shared
+ * counters.
+ */
+#define CONTEXT_OFFSET (ALLOC_NAME_MAX + 1)
+
+struct context {
+    atomic_size_t live_bytes;
+    atomic_size_t peak_bytes;
+    _Atomic size_t soft_limit;
+    _Atomic size_t hard_limit;
+    atomic_size_t soft_breaches;
+    atomic_size_t hard_denials;
+};
+
+static struct context contexts[ALLOC_MAX_CONTEXTS];
+static __thread uint16_t my_context
+    __attribute__((tls_model("initial-exec"))) = 0;
+
+/*
+ * Empty regions returned by all arenas, kept on a lock-free stack (see
+ * lfstack.h) so any arena can pick them up without a shared lock.
+ */
+#define POOL_STEAL_TRIES 4
+static struct lfstack pool = LFSTACK_INIT;
+static atomic_size_t pool_bytes = 0;
+static atomic_size_t pool_steals = 0;
+static atomic_size_t pool_munmaps = 0;
+
+/*
+ * Emergency reserve (ALLOC_PARAM_EMERGENCY_RESERVE): a prefaulted region kept
+ * outside every arena. When mmap() fails, map_region() hands it out to
+ * malloc_critical() callers, or to anyone once an allocation has failed, so a
+ * process out of memory can still log and shut down cleanly.
+ */
+static _Atomic(struct region *) emergency = NULL;
+static _Atomic size_t emergency_size = 0;
+static atomic_size_t emergency_releases = 0;
+static atomic_bool heap_exhausted = false;
+static atomic_size_t alloc_failures = 0;
+static __thread bool my_critical_request
+    __attribute__((tls_model("initial-exec"))) = false;
+
+/* Heap iterations between allocator_iterate_begin() and _end() */
+static atomic_size_t active_iterators = 0;
+
+/* Pending remote frees that make the freeing thread try to release them */
+#define REMOTE_DRAIN_BATCH 64
+
+/* Largest payload we accept; anything bigger would overflow the block size */
+#define MAX_REQUEST (PTRDIFF_MAX - sizeof(struct mem_block) - ALIGNMENT)
+
+/* Most slack realloc_impl() will reserve when a block keeps growing */
+#define REALLOC_MAX_SLACK (64 * 1024 * 1024)
+/* A grown block shrunk below 1/N of its capacity gives its slack back */
+#define REALLOC_SHRINK_RATIO 4
+
+/*
+ * Regions mapped on free list misses start at REGION_MIN_SIZE and double with
+ * every further miss in the same size class, but never exceed half the arena's
+ * heap or the ALLOC_PARAM_REGION_MAX tunable.
+ */
+#define REGION_MIN_SIZE (16 * 1024)
+#define REGION_MAX_SHIFT 20
+
+/* Tunables, see allocator_set_param() */
+static _Atomic size_t mmap_threshold = 128 * 1024;
+static _Atomic size_t trim_threshold = 128 * 1024;
+static _Atomic size_t top_pad = 0;
+static _Atomic size_t tcache_budget = 256 * 1024;
+static _Atomic size_t walk_threads = 0;
+static _Atomic size_t region_max = 4 * 1024 * 1024;
+
+/*
+ * Per-thread caches of freed small blocks, one bin per block size. A bin's
+ * capacity is retuned every TCACHE_TUNE_INTERVAL cache operations: it doubles
+ * when many mallocs miss or frees overflow (up to the thread's budget), and
+ * halves when the bin never dropped below half full.
+ */
+#define TCACHE_MAX_BLOCK 1024
+#define TCACHE_BINS \
+    ((TCACHE_MAX_BLOCK - sizeof(struct free_block)) / ALIGNMENT + 1)
+#define TCACHE_MIN_CAP 2
+#define TCACHE_MAX_CAP 512
+#define TCACHE_TUNE_INTERVAL 4096
+/* Fewest operations in an interval before a bin's miss rate means anything */
+#define TCACHE_TUNE_MIN_OPS 16
+/* Left in my_tcache once the thread's cache has been torn down at exit */
+#define TCACHE_OFF ((struct tcache *) 1)
+
+struct tcache_bin {
+    /** Cached blocks, chained through their first data bytes */
+    void *head;
+    uint32_t count;
+    uint32_t capacity;
+
+    /* Activity since the last tuning pass */
+    uint32_t ops;
+    uint32_t gets;
+    uint32_t misses;
+    uint32_t overflows;
+    /** Fewest blocks the bin held */
+    uint32_t low;
+};
+
+struct tcache {
+    struct tcache_bin bins[TCACHE_BINS];
+    size_t capacity_bytes;
+    uint32_t ops;
+};
+
+static __thread struct tcache *my_tcache
+    __attribute__((tls_model("initial-exec"))) = NULL;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_size_t tcache_hits = 0;
+static atomic_size_t tcache_misses = 0;
+static atomic_size_t tcache_overflows = 0;
+static atomic_size_t tcache_grows = 0;
+static atomic_size_t tcache_shrinks = 0;
+static atomic_size_t tcache_denials = 0;
+static atomic_size_t tcache_capacity = 0;
 
 /**
  * Rounds stuff up to the nearest dividend.
@@ -47,37 +212,391 @@ size_t align(size_t orig_size, size_t alignment)
 
 void set_free(struct mem_block *block)
 {
-    block->size = block->size | 0x01;
+    block->size = block->size | BLOCK_FREE;
 }
 
 void set_used(struct mem_block *block)
 {
-    block->size = block->size & ~(0x01);
+    block->size = block->size & ~(BLOCK_FREE);
 }
 
 size_t real_size(size_t size)
 {
-    return size & ~(0x01);
+    return size & ~(BLOCK_FLAGS);
 }
 
 bool is_free(struct mem_block *block) 
 {
-    return (block->size & 0x01) == 0x01;
+    return (block->size & BLOCK_FREE) == BLOCK_FREE;
+}
+
+static size_t page_size(void)
+{
+    static size_t ps = 0;
+    if (ps == 0) {
+        ps = (size_t) sysconf(_SC_PAGESIZE);
+    }
+    return ps;
+}
+
+/**
+ * Maps 'size' bytes of anonymous memory for a region. Regions and their blocks
+ * get pushed onto lock-free stacks, so a mapping those can't address (see
+ * lfstack_fits()) is given back and treated like a failed mmap().
+ */
+static void *map_pages(size_t size, int flags)
+{
+    void *pages = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if (pages != MAP_FAILED && !lfstack_fits(pages, size)) {
+        LOG("mapping at %p is above the lock-free stacks' reach\n", pages);
+        munmap(pages, size);
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    return pages;
+}
+
+/**
+ * Hashes a block name (as far as it is kept) to one bit of a region's tag
+ * filter, see free_tagged().
+ */
+static unsigned int tag_bit(const char *name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < ALLOC_NAME_MAX && name[i] != '\0'; ++i) {
+        hash = (hash ^ (unsigned char) name[i]) * 1099511628211ULL;
+    }
+    return hash % 128;
+}
+
+static void set_name(struct mem_block *block, const char *name)
+{
+    if (name == NULL) {
+        name = "";
+    }
+    strncpy(block->name, name, ALLOC_NAME_MAX);
+    block->name[ALLOC_NAME_MAX] = '\0';
+
+    if (name[0] != '\0') {
+        /* Blocks served from a thread cache are named without the lock */
+        unsigned int bit = tag_bit(name);
+        struct region *region = (struct region *) block->region - 1;
+        __atomic_fetch_or(&region->tags[bit / 64], 1ULL << (bit % 64),
+                __ATOMIC_RELAXED);
+    }
+}
+
+static unsigned int block_context(struct mem_block *block)
+{
+    uint16_t ctx;
+    memcpy(&ctx, block->name + CONTEXT_OFFSET, sizeof(ctx));
+    return ctx;
+}
+
+static void set_context(struct mem_block *block, unsigned int ctx)
+{
+    uint16_t id = ctx;
+    memcpy(block->name + CONTEXT_OFFSET, &id, sizeof(id));
+}
+
+/**
+ * Charges 'bytes' to a context. Unless 'enforce' is false, the charge is
+ * refused if it would take the context over its hard limit; crossing the soft
+ * limit is only counted and logged.
+ */
+static bool context_charge(unsigned int ctx, size_t bytes, bool enforce)
+{
+    if (ctx == 0 || bytes == 0) {
+        return true;
+    }
+
+    struct context *context = &contexts[ctx];
+    size_t live = atomic_fetch_add(&context->live_bytes, bytes) + bytes;
+    size_t hard = context->hard_limit;
+    if (enforce && hard != 0 && live > hard) {
+        atomic_fetch_sub(&context->live_bytes, bytes);
+        return false;
+    }
+
+    size_t soft = context->soft_limit;
+    if (soft != 0 && live > soft && live - bytes <= soft) {
+        atomic_fetch_add(&context->soft_breaches, 1);
+        LOG("context %u is over its soft limit (%zu > %zu bytes)\n",
+                ctx, live, soft);
+    }
+
+    size_t peak = context->peak_bytes;
+    while (live > peak && !atomic_compare_exchange_weak(
+                &context->peak_bytes, &peak, live)) {
+    }
+    return true;
+}
+
+static void context_credit(unsigned int ctx, size_t bytes)
+{
+    if (ctx != 0) {
+        atomic_fetch_sub(&contexts[ctx].live_bytes, bytes);
+    }
+}
+
+static struct region *region_of(struct mem_block *block)
+{
+    return (struct region *) block->region - 1;
+}
+
+static struct arena *arena_of(struct mem_block *block)
+{
+    return region_of(block)->arena;
+}
+
+static struct region_desc *region_desc_of(struct mem_block *block)
+{
+    struct region *region = region_of(block);
+    return &region->arena->regions[region->slot];
+}
+
+/**
+ * A region is empty once none of its bytes are in used blocks; free neighbors
+ * are always merged, so its first block then spans the entire region.
+ */
+static bool region_empty(struct mem_block *block)
+{
+    return region_desc_of(block)->used_bytes == 0;
 }
 
 void add_free(struct mem_block *block) 
 {
+    struct arena *arena = arena_of(block);
     set_free(block);
     struct free_block *fblock = (struct free_block *) block;
 
-    if (free_head == NULL && free_tail == NULL) {
-        free_head = fblock;
-        free_tail = fblock;
+    fblock->prev_free = NULL;
+    fblock->next_free = arena->free_head;
+    if (arena->free_head == NULL) {
+        arena->free_tail = fblock;
+    } else {
+        arena->free_head->prev_free = fblock;
+    }
+    arena->free_head = fblock;
+}
+
+static void remove_free(struct mem_block *block)
+{
+    struct arena *arena = arena_of(block);
+    struct free_block *fblock = (struct free_block *) block;
+
+    if (fblock->prev_free == NULL) {
+        arena->free_head = fblock->next_free;
+    } else {
+        fblock->prev_free->next_free = fblock->next_free;
+    }
+
+    if (fblock->next_free == NULL) {
+        arena->free_tail = fblock->prev_free;
+    } else {
+        fblock->next_free->prev_free = fblock->prev_free;
+    }
+
+    fblock->next_free = NULL;
+    fblock->prev_free = NULL;
+}
+
+/**
+ * Moves 'delta' bytes of a region between its free and used totals.
+ */
+static void region_used(struct mem_block *block, ptrdiff_t delta)
+{
+    struct region_desc *desc = region_desc_of(block);
+    desc->used_bytes += delta;
+    desc->free_bytes -= delta;
+}
+
+/**
+ * Adds a descriptor for a newly mapped (or reused) region to the arena's
+ * region table, growing the table if needed. The table is mapped directly
+ * since it grows while the arena's lock is held.
+ */
+static bool region_table_add(struct arena *arena, struct region *region)
+{
+    if (arena->region_count == arena->region_capacity) {
+        size_t capacity = arena->region_capacity == 0
+            ? page_size() / sizeof(struct region_desc)
+            : arena->region_capacity * 2;
+        void *table = arena->regions == NULL
+            ? mmap(NULL, capacity * sizeof(struct region_desc),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+            : mremap(arena->regions,
+                    arena->region_capacity * sizeof(struct region_desc),
+                    capacity * sizeof(struct region_desc), MREMAP_MAYMOVE);
+        if (table == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        arena->regions = table;
+        arena->region_capacity = capacity;
+    }
+
+    region->slot = arena->region_count++;
+    arena->regions[region->slot] = (struct region_desc) {
+        .base = region,
+        .size = region->size,
+        .free_bytes = region->size - sizeof(struct region),
+        .arena = arena,
+    };
+    return true;
+}
+
+/**
+ * Squeezes out the holes unmapped regions left while iterations were running,
+ * keeping the remaining descriptors in order.
+ */
+static void region_table_compact(struct arena *arena)
+{
+    size_t kept = 0;
+    for (size_t r = 0; r < arena->region_count; ++r) {
+        struct region_desc *desc = &arena->regions[r];
+        if (desc->base == NULL) {
+            continue;
+        }
+        if (r != kept) {
+            arena->regions[kept] = *desc;
+            desc->base->slot = kept;
+        }
+        kept++;
+    }
+    arena->region_count = kept;
+    arena->region_holes = 0;
+}
+
+/**
+ * Drops a region's descriptor by moving the last descriptor into its slot, or
+ * leaves a hole in the slot while an iteration might be paused past it.
+ */
+static void region_table_remove(struct arena *arena, struct region *region)
+{
+    if (atomic_load(&active_iterators) > 0) {
+        arena->regions[region->slot].base = NULL;
+        arena->region_holes++;
+        return;
+    }
+    if (arena->region_holes > 0) {
+        arena->regions[region->slot].base = NULL;
+        arena->region_holes++;
+        region_table_compact(arena);
+        return;
+    }
+
+    struct region_desc *last = &arena->regions[--arena->region_count];
+    if (last->base != region) {
+        arena->regions[region->slot] = *last;
+        last->base->slot = region->slot;
+    }
+}
+
+/**
+ * Inserts a new block into its region's block list directly after 'prev'. If
+ * 'prev' is NULL, the block starts the list of a new region.
+ */
+static void blist_insert(struct mem_block *prev, struct mem_block *block)
+{
+    block->prev_block = prev;
+    if (prev == NULL) {
+        block->next_block = NULL;
     } else {
-        fblock->next_free = free_head;
-        free_head->prev_free = fblock;
-        free_head = fblock;
+        block->next_block = prev->next_block;
+        prev->next_block = block;
+        if (block->next_block != NULL) {
+            block->next_block->prev_block = block;
+        }
+    }
+    struct region_desc *desc = region_desc_of(block);
+    desc->blocks++;
+    desc->version++;
+}
+
+static void blist_remove(struct mem_block *block)
+{
+    if (block->prev_block != NULL) {
+        block->prev_block->next_block = block->next_block;
+    }
+    if (block->next_block != NULL) {
+        block->next_block->prev_block = block->prev_block;
+    }
+    struct region_desc *desc = region_desc_of(block);
+    desc->blocks--;
+    desc->version++;
+}
+
+/**
+ * Takes an arena's lock, counting the acquisitions that had to wait and how
+ * long they waited. The clock is only read once the lock turns out to be busy.
+ */
+static void arena_lock(struct arena *arena)
+{
+    if (pthread_mutex_trylock(&arena->lock) == 0) {
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&arena->lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    arena->totals.lock_contentions++;
+    arena->totals.lock_wait_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL
+        + end.tv_nsec - start.tv_nsec;
+}
+
+/**
+ * Number of arena slots walks have to cover: the regular arenas handed out so
+ * far, or all of them plus the critical ones once any have been claimed.
+ */
+static size_t arena_span(void)
+{
+    size_t critical = critical_count;
+    return critical > 0 ? ALLOC_MAX_ARENAS + critical : arena_count;
+}
+
+/**
+ * Picks the next regular arena round-robin.
+ */
+static struct arena *round_robin_arena(void)
+{
+    size_t limit = arena_limit;
+    if (limit == 0) {
+        /* Default to one arena per CPU we're allowed to run on */
+        cpu_set_t cpus;
+        limit = sched_getaffinity(0, sizeof(cpus), &cpus) == 0
+            ? (size_t) CPU_COUNT(&cpus) : 1;
+        if (limit > ALLOC_MAX_ARENAS) {
+            limit = ALLOC_MAX_ARENAS;
+        }
+        size_t expected = 0;
+        if (!atomic_compare_exchange_strong(&arena_limit, &expected, limit)) {
+            limit = expected;
+        }
+    }
+
+    size_t index = atomic_fetch_add(&next_arena, 1) % limit;
+    size_t count = arena_count;
+    while (count < index + 1 && !atomic_compare_exchange_weak(
+                &arena_count, &count, index + 1)) {
+    }
+
+    return &arenas[index];
+}
+
+/**
+ * Picks the calling thread's arena, assigning arenas round-robin the first
+ * time a thread allocates. The main thread always ends up with arena 0.
+ */
+static struct arena *thread_arena(void)
+{
+    if (my_arena == NULL) {
+        my_arena = round_robin_arena();
     }
+    return my_arena;
 }
 
 /**
@@ -104,69 +623,37 @@ void add_free(struct mem_block *block)
  */
 struct mem_block *split_block(struct mem_block *block, size_t size)
 {
-    // TODO block splitting algorithm
-    // check the block is:
-    // * not null
-    // * actually has enough space for the request
-    // * after subtracting whatever the request is, still has enough space for two complete blocks (min_size(80))
-
-    size_t min_size = 80;
-    if (block == NULL || size < min_size) {
-        // LOGP("block == null or size < 80");
+    size_t min_size = sizeof(struct free_block);
+    if (block == NULL || size < min_size || !is_free(block)) {
         return NULL;
-    } 
+    }
 
     size_t block_size = real_size(block->size);
-    // LOG("size here = %lu\n", block_size);
-    struct mem_block *new_block = (struct mem_block *) ((char *) block + block_size - size);
-
-    if (block_size < min_size) {
-        // LOGP("block size < min size");
+    if (block_size < size || block_size - size < min_size) {
         return NULL;
     }
 
-    if (!is_free(block)) {
-        // LOGP("not free");
-        return NULL;
-    }
+    struct mem_block *new_block
+        = (struct mem_block *) ((char *) block + block_size - size);
 
-    if (block->next_block == NULL) {
-        // LOGP("block too small/not enough space");
-        return NULL;
-    } else {
-        // LOGP("splitting");
-        new_block->next_block = block->next_block; // result->next_block == next_block [  OK  ]
-        // LOG("block->next_block = %lu\n", block->next_block);
-        // LOG("new_block->next_block = %lu\n", new_block->next_block);
-
-        block->next_block = new_block; // block->next_block == result [ OK ]
-        // LOG("block->next_block = %lu\n", block->next_block);
-        // LOG("new_block = %lu\n", new_block);
-
-        new_block->prev_block = block; // result->prev_block == block [ OK ]
-        // LOG("block->prev_block = %lu\n", block->prev_block);
-        // LOG("new_block = %lu\n", new_block);
-
-        new_block->next_block->prev_block = new_block; // next_block->prev_block == result [ OK ]
-        // LOG("new_block->next_block->prev_block = %lu\n", new_block->next_block->prev_block);
-        // LOG("new_block = %lu\n", new_block);
-
-        ssize_t new_size = block->size - size;
-        // LOG("new_size: %lu\n", new_size);
-        block->size = new_size; // block->size == 7265 [  OK  ]
-
-        new_block->size = block_size;
-        // LOG("new_block->size %lu\n", new_block->size); // 8000
-        // LOG("result->size %lu\n", new_block->size); // 735
-    
-        ssize_t new_block_new_size = new_block->size - new_size;
-        // LOG("new_block_new_size: %lu\n", new_block_new_size);
-        new_block->size = new_block_new_size + 2; // result->size == 737 [  OK  ]
+    new_block->region = block->region;
+    new_block->name[0] = '\0';
+    new_block->size = size | BLOCK_FREE;
+    block->size = (block_size - size) | (block->size & BLOCK_FLAGS);
+    blist_insert(block, new_block);
 
-        return new_block;
-    }
+    return new_block;
+}
 
-    new_block->region = block->region;
+/**
+ * Absorbs 'right' into 'left'. Both blocks must be free, adjacent, and in the
+ * same region; 'right' is removed from both the block list and free list.
+ */
+static void right_merge(struct mem_block *left, struct mem_block *right)
+{
+    remove_free(right);
+    blist_remove(right);
+    left->size += real_size(right->size);
 }
 
 /**
@@ -199,55 +686,38 @@ struct mem_block *split_block(struct mem_block *block, size_t size)
  */
 struct mem_block *merge_block(struct mem_block *block)
 {
-    // TODO block merging algorithm
-
-    /**
-     * Big assumption: We make sure there are never two...
-     * 
-     * 
-     * 1. is the block free?
-     * 2. who are my neighbors? (look at next and previous blocks (not next_free))
-     *      merging = block list not free list
-     * 3. are my neighbors in the same region?
-     *      if not, can't merge with them
-     * 4. are my neighbors free?
-     *      if they are, we can merge with them
-     * 
-     * assuming we actully need to merge, start doing this:
-     * 1. start w/ merge to the right
-     *      go to the next block, and if it's free, combine with the current block
-     *      increase the size
-     *      update the linked list
-     *      remove the neighbor from the free list
-     * 2. next do a merge "to the left"
-     *      this works exactly the same as merge to the right, except for:
-     *          we merge the previous block to the right into our current block
-     *      make a function that takes in two blocks, left and right
-     *      use this function like:
-     *          right_merge(current, next);
-     *          right_merge(previous, current);
-     *          you will eventually use this for realloc()
-     * 3. at the very end after we've done our merges, return the leftmost block
-     *      so if the first right merge worked and the second didn't, then we return the current
-     *      and if the second right merge worked, return the previous block
-     **/
+    if (block == NULL || !is_free(block)) {
+        return NULL;
+    }
 
-    return NULL;
+    struct mem_block *merged = NULL;
+
+    struct mem_block *next = block->next_block;
+    if (next != NULL && next->region == block->region && is_free(next)) {
+        right_merge(block, next);
+        merged = block;
+    }
+
+    struct mem_block *prev = block->prev_block;
+    if (block != block->region && prev != NULL && is_free(prev)) {
+        right_merge(prev, block);
+        merged = prev;
+    }
+
+    return merged;
 }
 
 /**
  * Given a block size (header + data), locate a suitable location in the free
  * list using the first fit free space management algorithm.
  *
+ * @param arena arena whose free list is searched
  * @param size size of the block (header + data)
  */
-void *first_fit(size_t size)
+void *first_fit(struct arena *arena, size_t size)
 {
-    // TODO: first fit FSM implementation
-
-    struct free_block *free = free_head;
+    struct free_block *free = arena->free_head;
     while (free != NULL) {
-        LOG("FF checking [%p]\n", free);
         if (real_size(free->block.size) >= size) {
             return free;
         }
@@ -262,12 +732,22 @@ void *first_fit(size_t size)
  * (i.e., you find multiple worst fit candidates with the same size), use the
  * first candidate found in the list.
  *
+ * @param arena arena whose free list is searched
  * @param size size of the block (header + data)
  */
-void *worst_fit(size_t size)
+void *worst_fit(struct arena *arena, size_t size)
 {
-    // TODO: worst fit FSM implementation
-    return NULL;
+    struct free_block *worst = NULL;
+    struct free_block *free = arena->free_head;
+    while (free != NULL) {
+        size_t free_size = real_size(free->block.size);
+        if (free_size >= size
+                && (worst == NULL || free_size > real_size(worst->block.size))) {
+            worst = free;
+        }
+        free = free->next_free;
+    }
+    return worst;
 }
 
 /**
@@ -276,186 +756,1841 @@ void *worst_fit(size_t size)
  * (i.e., you find multiple best fit candidates with the same size), use the
  * first candidate found in the list.
  *
+ * @param arena arena whose free list is searched
  * @param size size of the block (header + data)
  */
-void *best_fit(size_t size)
+void *best_fit(struct arena *arena, size_t size)
 {
-    // TODO: best fit FSM implementation
-    return NULL;
+    struct free_block *best = NULL;
+    struct free_block *free = arena->free_head;
+    while (free != NULL) {
+        size_t free_size = real_size(free->block.size);
+        if (free_size >= size
+                && (best == NULL || free_size < real_size(best->block.size))) {
+            best = free;
+            if (free_size == size) {
+                break;
+            }
+        }
+        free = free->next_free;
+    }
+    return best;
 }
 
-void *reuse(size_t size)
-{
-    // TODO: using free space management (FSM) algorithms, find a block of
-    // memory that we can reuse. Return NULL if no suitable block is found.
-    return NULL;
-
-    // char *algo = getenv("ALLOCATOR_ALGORITHM");
-    // if (algo == NULL) {
-    //     algo = "first_fit";
-    // }
-
-    // struct mem_block *reused_block = NULL;
-    // if (strcmp(algo, "first_fit") == 0) {
-    //     reused_block = first_fit(size);
-    // } else if (strcmp(algo, "best_fit") == 0) {
-    //     reused_block = best_fit(size);
-    // } else if (strcmp(algo, "worst_fit") == 0) {
-    //     reused_block = worst_fit(size);
-    // }
-
-    // if (reused_block != NULL) {
-    //     // do stuff = potentially split the block if it can be split
-    //     LOG("Found a block to reuse: %p\n", reused_block);
+/**
+ * Uses the free space management algorithm selected by ALLOCATOR_ALGORITHM
+ * (first_fit, best_fit, or worst_fit; first_fit by default) to find a free
+ * block of at least 'size' bytes (header + data) in 'arena'. The block is split
+ * if it's large enough, and the returned block is marked as used. Must be
+ * called with the arena's lock held.
+ *
+ * @return the block to reuse, or NULL if no suitable block was found.
+ */
+static void *(*fit)(struct arena *, size_t) = NULL;
+/* Set when ALLOCATOR_ALGORITHM picks the fit explicitly */
+static bool fit_explicit = false;
 
-    //     // problems:
-    //     // 1. we don't remove anything from the free list
-    //     // 2. we don't update the free flags (could be done in #1)
-    //     // 3. we don't split the blocks we find
-    //     // 4. we don't merge blocks
-    //     // 5. we don't munmap them when the blocks represent a single
-    // }
+static void choose_fit(void)
+{
+    if (fit != NULL) {
+        return;
+    }
 
-    // return reused_block;
+    char *algo = getenv("ALLOCATOR_ALGORITHM");
+    fit_explicit = algo != NULL;
+    if (algo != NULL && strcmp(algo, "best_fit") == 0) {
+        fit = best_fit;
+    } else if (algo != NULL && strcmp(algo, "worst_fit") == 0) {
+        fit = worst_fit;
+    } else {
+        fit = first_fit;
+    }
 }
 
-void *malloc_impl(size_t size, char *name)
+void *reuse(struct arena *arena, size_t size)
 {
-    // TODO: allocate memory. You'll first check if you can reuse an existing
-    // block. If not, map a new memory region.
-    // return NULL;
-
-    pthread_mutex_lock(&lock);
+    choose_fit();
 
-    size_t actual_size = size + sizeof(struct mem_block);
-    size_t aligned_size = align(actual_size, ALIGNMENT);
-
-    struct mem_block *reused_block = reuse(aligned_size);
-    if (reused_block != NULL) {
-        set_used(reused_block);
-        pthread_mutex_unlock(&lock);
-        return reused_block + 1;
-    }
-
-    // size_region_size = align();
-    struct mem_block *block = mmap(
-        NULL,
-        actual_size, // replace
-        PROT_READ | PROT_WRITE,
-        MAP_PRIVATE | MAP_ANONYMOUS,
-        -1,
-        0);
-    
-    if (block == MAP_FAILED) {
-        perror("mmap");
-        pthread_mutex_unlock(&lock);
+    struct mem_block *reused_block = fit(arena, size);
+    if (reused_block == NULL) {
         return NULL;
     }
 
-    strcpy(block->name, name);
-    block->region = block;
-    // block->size = region_size;
-
-    set_free(block);
-    split_block(block, real_size(block->size) - aligned_size);
-    set_used(block);
-
-    //todo here
-    // 1. block list contains a region with two blocks
-    // 2. free list contains one block (the one we just split off from first block)
-
-    block->size = actual_size;
-    pthread_mutex_unlock(&lock);
-
-    // scribble
-    char *scribble = getenv("ALLOCATOR_SCRIBBLE");
-    if (scribble != NULL) {
-        memset(block + 1, 0xAA, actual_size);
+    struct mem_block *split = split_block(reused_block, size);
+    if (split != NULL) {
+        reused_block = split;
+    } else {
+        remove_free(reused_block);
     }
 
-    return block + 1;
-
+    set_used(reused_block);
+    region_used(reused_block, real_size(reused_block->size));
+    return reused_block;
 }
 
-void free_impl(void *ptr)
+static void thread_faults(size_t *minor, size_t *major)
 {
-    if (ptr == NULL) {
-        /* Freeing a NULL pointer does nothing */
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == -1) {
+        *minor = *major = 0;
         return;
     }
-    
-    struct mem_block *block = (struct mem_block *)ptr - 1;
-    // LOG("free request on %p; header: %p; block size: %zu\n", ptr, block, block->size);
-
-    add_free(block);
-
-    // struct mem_block *merged = merge_block(block);
-    // if (merged->next_block is in a different region)
-    //     and merged->prev_block is in a different region {
-    //         we are alone!!
-    //         update the linked list again since our block is gone
-    //         unmap
-    //     }
-
-    // LOGP("not munmappping for later - fix later\n");
-    // if (munmap(header, header->size) == -1) {
-    //     perror("munmap");
-    // }
-    // LOGP("done freeing\n");
-
-    // TODO: free memory. If the containing region is empty (i.e., there are no
-    // more blocks in use), then it should be unmapped.
+    *minor = usage.ru_minflt;
+    *major = usage.ru_majflt;
 }
 
-void *calloc_impl(size_t nmemb, size_t size, char *name)
+static struct region *pool_region(struct lfstack_node *node)
 {
-    // TODO: hmm, what does calloc do?
-    void *ptr = malloc_impl(nmemb * size, name);
-    memset(ptr, 0, nmemb * size);
-    return ptr;
-
-    // return NULL;
+    return (struct region *) ((char *) node - offsetof(struct region, link));
 }
 
-void *realloc_impl(void *ptr, size_t size, char *name)
+static struct lfstack_node *pool_link(struct region *region)
 {
-    // if (ptr == NULL) {
-    //     /* If the pointer is NULL, then we simply malloc a new block */
-    //     return malloc_impl(size, name);
-    // }
-
-    // if (size == 0) {
-    //     /* Realloc to 0 is often the same as freeing the memory block... But the
-    //      * C standard doesn't require this. We will free the block and return
-    //      * NULL here. */
-    //     free_impl(ptr);
-    //     return NULL;
-    // }
-
-    // // // TODO: reallocation logic
+    return (struct lfstack_node *) ((char *) region
+            + offsetof(struct region, link));
+}
 
-    // return NULL;
+static void pool_push(struct region *region)
+{
+    atomic_fetch_add(&pool_bytes, region->size);
+    lfstack_push(&pool, pool_link(region));
+}
 
-    void *new_ptr = malloc(size);
-    if (new_ptr == NULL) {
-        // return NULL;
-        return malloc_impl(size, name);
+static struct region *pool_pop(void)
+{
+    struct lfstack_node *node = lfstack_pop(&pool);
+    if (node == NULL) {
+        return NULL;
     }
 
-    // If NULL ptr passed into realloc, then it acts just like malloc:
-    if (ptr == NULL) {
-        return new_ptr;
-    }
+    struct region *region = pool_region(node);
+    atomic_fetch_sub(&pool_bytes, region->size);
+    return region;
+}
 
-    // We know the ptr is not NULL at this point:
-    if (size == 0) {
-        free(new_ptr);
-        return NULL;
+/**
+ * Takes an empty region of at least 'size' bytes from the pool. Only the top
+ * few regions are considered; any that are too small are pushed back.
+ */
+static struct region *pool_steal(size_t size)
+{
+    struct region *skipped[POOL_STEAL_TRIES];
+    int nskipped = 0;
+
+    struct region *region = NULL;
+    while (nskipped < POOL_STEAL_TRIES) {
+        region = pool_pop();
+        if (region == NULL || region->size >= size) {
+            break;
+        }
+        skipped[nskipped++] = region;
+        region = NULL;
     }
 
-    memcpy(new_ptr, ptr, size);
-    free(ptr);
-    return new_ptr;
+    while (nskipped > 0) {
+        pool_push(skipped[--nskipped]);
+    }
+    return region;
+}
+
+/**
+ * Maps 'size' bytes for the emergency reserve unless a reserve is already
+ * held. Pages are populated up front so the reserve is still usable once the
+ * system is out of memory.
+ */
+static void emergency_refill(void)
+{
+    size_t size = align(emergency_size, page_size());
+    if (size == 0 || atomic_load(&emergency) != NULL) {
+        return;
+    }
+
+    struct region *region = map_pages(size, MAP_POPULATE);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+    region->size = size;
+    region->minor_faults = 0;
+    region->major_faults = 0;
+    region->arena = NULL;
+
+    struct region *expected = NULL;
+    if (atomic_compare_exchange_strong(&emergency, &expected, region)) {
+        atomic_store(&heap_exhausted, false);
+    } else {
+        munmap(region, size);
+    }
+}
+
+/**
+ * Unmaps the emergency reserve, if one is held.
+ */
+static void emergency_release(void)
+{
+    struct region *region = atomic_exchange(&emergency, NULL);
+    if (region != NULL && munmap(region, region->size) == -1) {
+        perror("munmap");
+    }
+}
+
+/**
+ * Hands out the emergency reserve if the calling allocation may use it and it
+ * holds at least 'size' bytes.
+ */
+static struct region *emergency_claim(size_t size)
+{
+    if (!my_critical_request && !atomic_load(&heap_exhausted)) {
+        return NULL;
+    }
+
+    struct region *region = atomic_exchange(&emergency, NULL);
+    if (region != NULL && region->size < size) {
+        struct region *expected = NULL;
+        if (!atomic_compare_exchange_strong(&emergency, &expected, region)) {
+            munmap(region, region->size);
+        }
+        return NULL;
+    }
+    if (region != NULL) {
+        atomic_fetch_add(&emergency_releases, 1);
+        LOG("out of memory, using the %zu-byte emergency reserve\n",
+                region->size);
+    }
+    return region;
+}
+
+/**
+ * Chooses how large a region to map for a free list miss on a block of 'size'
+ * bytes: REGION_MIN_SIZE doubled for every region already mapped for the
+ * block's size class, capped at half the arena's (non-dedicated) heap and at
+ * ALLOC_PARAM_REGION_MAX. Small programs keep small mappings while a growing
+ * heap gets geometrically fewer, larger ones.
+ */
+static size_t region_target(struct arena *arena, size_t size)
+{
+    unsigned int grown = arena->class_regions[alloc_size_class(size)];
+    if (grown > REGION_MAX_SHIFT) {
+        grown = REGION_MAX_SHIFT;
+    }
+
+    size_t heap = arena->totals.mapped_bytes - arena->totals.dedicated_bytes;
+    size_t target = (size_t) REGION_MIN_SIZE << grown;
+    if (target > heap / 2) {
+        target = heap / 2 < REGION_MIN_SIZE ? REGION_MIN_SIZE : heap / 2;
+    }
+    return target > region_max ? region_max : target;
+}
+
+/**
+ * Provides a new region large enough to hold a block of 'size' bytes (header +
+ * data) and adds it to the end of the arena's block list. Empty regions in the
+ * pool are reused before mapping new memory; otherwise the mapping is sized by
+ * region_target(). The region starts out as a single used block; any leftover
+ * space is split off and added to the free list unless the region is dedicated
+ * to this one allocation.
+ */
+static struct mem_block *map_region(struct arena *arena, size_t size,
+        bool dedicated)
+{
+    size_t region_size = align(sizeof(struct region) + size
+            + (dedicated ? 0 : top_pad), page_size());
+
+    struct region *region = dedicated ? NULL : pool_steal(region_size);
+    if (region != NULL) {
+        atomic_fetch_add(&pool_steals, 1);
+        region_size = region->size;
+    } else {
+        size_t needed = region_size;
+        if (!dedicated) {
+            size_t target = align(region_target(arena, size), page_size());
+            if (target > region_size) {
+                region_size = target;
+            }
+            arena->class_regions[alloc_size_class(size)]++;
+        }
+
+        size_t minor_before, major_before;
+        thread_faults(&minor_before, &major_before);
+
+        region = map_pages(region_size, 0);
+
+        if (region == MAP_FAILED && region_size > needed) {
+            /* Settle for what the request needs before giving up */
+            region_size = needed;
+            region = map_pages(region_size, 0);
+        }
+
+        if (region == MAP_FAILED) {
+            perror("mmap");
+            region = emergency_claim(needed);
+            if (region == NULL) {
+                return NULL;
+            }
+            region_size = region->size;
+        } else {
+            /* Writing the header is the region's first touch */
+            region->size = region_size;
+
+            size_t minor_after, major_after;
+            thread_faults(&minor_after, &major_after);
+            region->minor_faults = minor_after - minor_before;
+            region->major_faults = major_after - major_before;
+
+            arena->totals.mmap_count++;
+            arena->totals.minor_faults += region->minor_faults;
+            arena->totals.major_faults += region->major_faults;
+        }
+    }
+
+    region->arena = arena;
+    region->link.next = NULL;
+    region->tags[0] = region->tags[1] = 0;
+    if (!region_table_add(arena, region)) {
+        region->arena = NULL;
+        pool_push(region);
+        return NULL;
+    }
+
+    struct mem_block *block = (struct mem_block *) (region + 1);
+    block->region = block;
+    block->name[0] = '\0';
+    block->size = (region_size - sizeof(struct region)) | BLOCK_FREE;
+    blist_insert(NULL, block);
+
+    arena->totals.mapped_bytes += region_size;
+    arena->totals.regions++;
+
+    if (dedicated) {
+        struct alloc_stats *totals = &arena->totals;
+        block->size |= BLOCK_DEDICATED;
+        totals->dedicated_bytes += region_size;
+        totals->dedicated_regions++;
+        if (totals->dedicated_regions > totals->max_dedicated_regions) {
+            totals->max_dedicated_regions = totals->dedicated_regions;
+        }
+        if (totals->dedicated_bytes > totals->max_dedicated_bytes) {
+            totals->max_dedicated_bytes = totals->dedicated_bytes;
+        }
+    } else {
+        struct mem_block *leftover
+            = split_block(block, real_size(block->size) - size);
+        if (leftover != NULL) {
+            add_free(leftover);
+        }
+    }
+
+    set_used(block);
+    region_used(block, real_size(block->size));
+    return block;
+}
+
+/**
+ * Maps a region of at least 'size' bytes for a latency-critical arena. Its
+ * pages are faulted in up front and locked into memory (if RLIMIT_MEMLOCK
+ * allows), so allocating from it never waits on a page fault. The region
+ * starts out as a single free block and is never unmapped.
+ */
+static bool reserve_region(struct arena *arena, size_t size)
+{
+    size_t region_size = align(sizeof(struct region) + size, page_size());
+
+    size_t minor_before, major_before;
+    thread_faults(&minor_before, &major_before);
+
+    struct region *region = map_pages(region_size, MAP_POPULATE);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    if (mlock(region, region_size) == 0) {
+        arena->totals.critical_locked_bytes += region_size;
+    } else {
+        LOG("could not lock %zu reserved bytes: %s\n", region_size,
+                strerror(errno));
+    }
+
+    size_t minor_after, major_after;
+    thread_faults(&minor_after, &major_after);
+    region->size = region_size;
+    region->minor_faults = minor_after - minor_before;
+    region->major_faults = major_after - major_before;
+    region->arena = arena;
+    region->link.next = NULL;
+    region->tags[0] = region->tags[1] = 0;
+    if (!region_table_add(arena, region)) {
+        munmap(region, region_size);
+        return false;
+    }
+
+    struct mem_block *block = (struct mem_block *) (region + 1);
+    block->region = block;
+    block->name[0] = '\0';
+    block->size = (region_size - sizeof(struct region)) | BLOCK_FREE;
+    blist_insert(NULL, block);
+    add_free(block);
+
+    arena->totals.mmap_count++;
+    arena->totals.minor_faults += region->minor_faults;
+    arena->totals.major_faults += region->major_faults;
+    arena->totals.mapped_bytes += region_size;
+    arena->totals.regions++;
+    arena->totals.critical_reserved_bytes += region_size;
+    return true;
+}
+
+/**
+ * Merges every run of adjacent free blocks in a latency-critical arena, the
+ * work its frees skip. Must be called with the arena's lock held.
+ *
+ * @return number of blocks merged away
+ */
+static size_t critical_coalesce(struct arena *arena)
+{
+    size_t merged = 0;
+    for (size_t r = 0; r < arena->region_count; ++r) {
+        struct region *region = arena->regions[r].base;
+        if (region == NULL) {
+            continue;
+        }
+
+        struct mem_block *block = (struct mem_block *) (region + 1);
+        for (; block != NULL; block = block->next_block) {
+            while (is_free(block) && block->next_block != NULL
+                    && is_free(block->next_block)) {
+                right_merge(block, block->next_block);
+                merged++;
+            }
+        }
+    }
+    return merged;
+}
+
+static void unmap_pooled(struct region *region)
+{
+    atomic_fetch_add(&pool_munmaps, 1);
+    if (munmap(region, region->size) == -1) {
+        perror("munmap");
+    }
+}
+
+/**
+ * Removes an empty (or dedicated) region from its arena's block and free lists.
+ * Regular regions go to the shared pool for any arena to reuse as long as the
+ * pool stays under the trim threshold; everything else is returned to the OS.
+ * Must be called with the arena's lock held.
+ */
+static void unmap_region(struct mem_block *block)
+{
+    struct region *region = region_of(block);
+    struct arena *arena = region->arena;
+    size_t region_size = region->size;
+    bool dedicated = (block->size & BLOCK_DEDICATED) == BLOCK_DEDICATED;
+
+    if (dedicated) {
+        arena->totals.dedicated_bytes -= region_size;
+        arena->totals.dedicated_regions--;
+    } else {
+        remove_free(block);
+    }
+    blist_remove(block);
+    region_table_remove(arena, region);
+
+    arena->totals.mapped_bytes -= region_size;
+    arena->totals.regions--;
+    region->arena = NULL;
+
+    if (!dedicated && atomic_load(&pool_bytes) + region_size <= trim_threshold) {
+        pool_push(region);
+        return;
+    }
+
+    if (!dedicated) {
+        /* The region may have been in the pool before: a pop that read it as
+         * the top before another thread took it can still be loading its
+         * link (see lfstack.h) */
+        lfstack_quiesce(&pool);
+    }
+    /* Blocks in the region may have been on the remote free stack too. It is
+     * only ever drained with lfstack_take_all(), but nothing may unmap a node
+     * while a pop of its stack is in flight */
+    lfstack_quiesce(&arena->remote_frees);
+    arena->totals.munmap_count++;
+    if (munmap(region, region_size) == -1) {
+        perror("munmap");
+    }
+}
+
+/**
+ * Sliding window over mincore() results for one region, so residency can be
+ * sampled block by block without allocating a vector for the whole region.
+ */
+struct resident_window {
+    uintptr_t base;
+    uintptr_t limit;
+    size_t pages;
+    unsigned char vec[1024];
+};
+
+static void resident_window_init(struct resident_window *window,
+        struct region *region)
+{
+    window->base = (uintptr_t) region;
+    window->limit = (uintptr_t) region + region->size;
+    window->pages = 0;
+}
+
+/**
+ * Counts how many bytes of [start, end) are backed by resident pages.
+ */
+static size_t resident_bytes(struct resident_window *window,
+        uintptr_t start, uintptr_t end)
+{
+    size_t ps = page_size();
+    size_t resident = 0;
+
+    while (start < end) {
+        uintptr_t page = start & ~(ps - 1);
+        if (page < window->base || page >= window->base + window->pages * ps) {
+            window->base = page;
+            window->pages = (window->limit - page) / ps;
+            if (window->pages > sizeof(window->vec)) {
+                window->pages = sizeof(window->vec);
+            }
+            if (mincore((void *) page, window->pages * ps, window->vec) == -1) {
+                memset(window->vec, 0, window->pages);
+            }
+        }
+
+        uintptr_t chunk_end = page + ps < end ? page + ps : end;
+        if (window->vec[(page - window->base) / ps] & 1) {
+            resident += chunk_end - start;
+        }
+        start = chunk_end;
+    }
+
+    return resident;
+}
+
+/**
+ * Maps a block size (header + data) to its power-of-two size class, used when
+ * breaking statistics down by size.
+ */
+int alloc_size_class(size_t size)
+{
+    int class = 0;
+    size_t limit = ALLOC_MIN_CLASS_SIZE;
+    while (size > limit && class < ALLOC_SIZE_CLASSES - 1) {
+        limit <<= 1;
+        class++;
+    }
+    return class;
+}
+
+/**
+ * Largest block size (header + data) that falls in the given size class. The
+ * last class has no upper bound.
+ */
+size_t alloc_size_class_limit(int class)
+{
+    if (class >= ALLOC_SIZE_CLASSES - 1) {
+        return SIZE_MAX;
+    }
+    return (size_t) ALLOC_MIN_CLASS_SIZE << class;
+}
+
+/**
+ * Computes the size of the block (header + data, aligned) needed to hold a
+ * payload of 'size' bytes. The caller must have checked that 'size' is below
+ * MAX_REQUEST.
+ */
+static size_t block_size(size_t size)
+{
+    size_t aligned_size = align(size + sizeof(struct mem_block), ALIGNMENT);
+    if (aligned_size < sizeof(struct free_block)) {
+        /* Every block must be able to hold the free list links once freed */
+        aligned_size = sizeof(struct free_block);
+    }
+    return aligned_size;
+}
+
+/**
+ * Returns a used block to the free list, merging it with its neighbors. If that
+ * leaves its region empty, the region is handed back (see unmap_region()).
+ * Blocks of a latency-critical arena are only put on the free list.
+ * Must be called with the owning arena's lock held.
+ */
+static void release_block(struct mem_block *block)
+{
+    block->size &= ~BLOCK_GROWN;
+    region_used(block, -(ptrdiff_t) real_size(block->size));
+    add_free(block);
+    if (arena_of(block)->critical) {
+        /* Keep frees constant-time; see critical_coalesce() */
+        return;
+    }
+    struct mem_block *merged = merge_block(block);
+    if (merged != NULL) {
+        block = merged;
+    }
+
+    if (region_empty(block)) {
+        unmap_region(block);
+    }
+}
+
+/**
+ * Releases the blocks other threads have freed into this arena since the last
+ * drain. Must be called with the arena's lock held.
+ */
+static void drain_remote(struct arena *arena)
+{
+    struct lfstack_node *node = lfstack_take_all(&arena->remote_frees);
+    while (node != NULL) {
+        struct lfstack_node *next = node->next;
+        struct mem_block *block = (struct mem_block *) node - 1;
+        block->size &= ~BLOCK_PARKED;
+        if (block->size & BLOCK_DEDICATED) {
+            unmap_region(block);
+        } else {
+            release_block(block);
+        }
+        arena->totals.remote_frees++;
+        node = next;
+    }
+}
+
+/**
+ * Hands a block owned by another thread's arena back without taking that
+ * arena's lock: the block is pushed onto the arena's remote free stack, using
+ * its first data bytes as the link. Once enough blocks pile up, the freeing
+ * thread releases them itself if the lock happens to be free.
+ */
+static void free_remote(struct arena *arena, struct mem_block *block)
+{
+    block->size |= BLOCK_PARKED;
+    lfstack_push(&arena->remote_frees, (struct lfstack_node *) (block + 1));
+
+    if (lfstack_length(&arena->remote_frees) >= REMOTE_DRAIN_BATCH
+            && pthread_mutex_trylock(&arena->lock) == 0) {
+        drain_remote(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+static size_t tcache_bin_index(size_t size)
+{
+    return (size - sizeof(struct free_block)) / ALIGNMENT;
+}
+
+static size_t tcache_bin_size(size_t index)
+{
+    return sizeof(struct free_block) + index * ALIGNMENT;
+}
+
+/**
+ * Returns blocks from a bin to the thread's arena until only 'keep' are left.
+ */
+static void tcache_flush_bin(struct tcache_bin *bin, uint32_t keep)
+{
+    if (bin->count <= keep) {
+        return;
+    }
+
+    arena_lock(my_arena);
+    while (bin->count > keep) {
+        struct mem_block *block = (struct mem_block *) bin->head - 1;
+        bin->head = *(void **) bin->head;
+        bin->count--;
+        block->size &= ~BLOCK_PARKED;
+        release_block(block);
+    }
+    pthread_mutex_unlock(&my_arena->lock);
+
+    if (bin->low > bin->count) {
+        bin->low = bin->count;
+    }
+}
+
+static void tcache_destroy(void *arg)
+{
+    struct tcache *cache = arg;
+    for (size_t i = 0; i < TCACHE_BINS; ++i) {
+        tcache_flush_bin(&cache->bins[i], 0);
+    }
+    atomic_fetch_sub(&tcache_capacity, cache->capacity_bytes);
+    munmap(cache, sizeof(*cache));
+    my_tcache = TCACHE_OFF;
+}
+
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/**
+ * Returns the calling thread's cache, creating it on first use, or NULL if
+ * thread caches are disabled. Caches are skipped when ALLOCATOR_ALGORITHM is
+ * set, since block placement should then follow the chosen fit exactly.
+ */
+static struct tcache *thread_cache(void)
+{
+    if (my_tcache != NULL) {
+        return my_tcache == TCACHE_OFF ? NULL : my_tcache;
+    }
+
+    choose_fit();
+    if (tcache_budget == 0 || fit_explicit) {
+        return NULL;
+    }
+
+    pthread_once(&tcache_key_once, tcache_key_create);
+
+    /* Mapped directly: the cache can't come from the heap it feeds */
+    struct tcache *cache = mmap(NULL, sizeof(*cache), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < TCACHE_BINS; ++i) {
+        cache->bins[i].capacity = TCACHE_MIN_CAP;
+        cache->capacity_bytes += TCACHE_MIN_CAP * tcache_bin_size(i);
+    }
+    atomic_fetch_add(&tcache_capacity, cache->capacity_bytes);
+
+    my_tcache = cache;
+    pthread_setspecific(tcache_key, cache);
+    return cache;
+}
+
+/**
+ * Takes a block of 'size' bytes out of the thread's cache and names it. The
+ * name is written before the block is unparked, so free_tagged() (which skips
+ * parked blocks under the arena lock) never matches a block being handed out
+ * by its old name.
+ */
+static struct mem_block *tcache_get(struct tcache *cache, size_t size,
+        const char *name)
+{
+    struct tcache_bin *bin = &cache->bins[tcache_bin_index(size)];
+    bin->ops++;
+    bin->gets++;
+    if (bin->head == NULL) {
+        bin->misses++;
+        return NULL;
+    }
+
+    struct mem_block *block = (struct mem_block *) bin->head - 1;
+    bin->head = *(void **) bin->head;
+    if (--bin->count < bin->low) {
+        bin->low = bin->count;
+    }
+    set_name(block, name);
+    __atomic_fetch_and(&block->size, ~(size_t) BLOCK_PARKED, __ATOMIC_RELEASE);
+    return block;
+}
+
+/**
+ * Parks a freed block in the thread's cache if its bin has room.
+ *
+ * @return false if the block has to go back to the arena instead
+ */
+static bool tcache_put(struct tcache *cache, struct mem_block *block)
+{
+    size_t size = real_size(block->size);
+    if (size > TCACHE_MAX_BLOCK || (block->size & BLOCK_DEDICATED)) {
+        return false;
+    }
+
+    struct tcache_bin *bin = &cache->bins[tcache_bin_index(size)];
+    bin->ops++;
+    if (bin->count >= bin->capacity) {
+        bin->overflows++;
+        return false;
+    }
+
+    block->size = (block->size & ~BLOCK_GROWN) | BLOCK_PARKED;
+    /* A parked block no longer carries its tag (see free_tagged()) */
+    block->name[0] = '\0';
+    *(void **) (block + 1) = bin->head;
+    bin->head = block + 1;
+    bin->count++;
+    return true;
+}
+
+/**
+ * Retunes every bin's capacity from its activity over the last interval and
+ * publishes the interval's counters.
+ */
+static void tcache_tune(struct tcache *cache)
+{
+    size_t hits = 0, misses = 0, overflows = 0;
+    size_t grows = 0, shrinks = 0, denials = 0;
+    size_t capacity_before = cache->capacity_bytes;
+
+    for (size_t i = 0; i < TCACHE_BINS; ++i) {
+        struct tcache_bin *bin = &cache->bins[i];
+        size_t bin_size = tcache_bin_size(i);
+        uint32_t churn = bin->misses + bin->overflows;
+
+        hits += bin->gets - bin->misses;
+        misses += bin->misses;
+        overflows += bin->overflows;
+
+        /* Only bins that see both mallocs and frees benefit from more room */
+        bool mixed = bin->gets > 0 && bin->gets < bin->ops;
+        if (mixed && bin->ops >= TCACHE_TUNE_MIN_OPS && churn * 8 > bin->ops
+                && bin->capacity < TCACHE_MAX_CAP) {
+            size_t grow = bin->capacity * bin_size;
+            if (cache->capacity_bytes + grow <= tcache_budget) {
+                cache->capacity_bytes += grow;
+                bin->capacity *= 2;
+                grows++;
+            } else {
+                denials++;
+            }
+        } else if (bin->low * 2 > bin->capacity
+                && bin->capacity > TCACHE_MIN_CAP) {
+            /* Half the bin sat unused for the whole interval */
+            bin->capacity /= 2;
+            cache->capacity_bytes -= bin->capacity * bin_size;
+            tcache_flush_bin(bin, bin->capacity);
+            shrinks++;
+        }
+
+        bin->ops = bin->gets = bin->misses = bin->overflows = 0;
+        bin->low = bin->count;
+    }
+    cache->ops = 0;
+
+    atomic_fetch_add(&tcache_hits, hits);
+    atomic_fetch_add(&tcache_misses, misses);
+    atomic_fetch_add(&tcache_overflows, overflows);
+    atomic_fetch_add(&tcache_grows, grows);
+    atomic_fetch_add(&tcache_shrinks, shrinks);
+    atomic_fetch_add(&tcache_denials, denials);
+    atomic_fetch_add(&tcache_capacity, cache->capacity_bytes);
+    atomic_fetch_sub(&tcache_capacity, capacity_before);
+}
+
+static void tcache_tick(struct tcache *cache)
+{
+    if (++cache->ops >= TCACHE_TUNE_INTERVAL) {
+        tcache_tune(cache);
+    }
+}
+
+/**
+ * Returns everything in the calling thread's cache to its arena, so walks of
+ * the heap see the blocks as free. Must be called without any lock held.
+ */
+static void tcache_flush_self(void)
+{
+    if (my_tcache == NULL || my_tcache == TCACHE_OFF) {
+        return;
+    }
+    for (size_t i = 0; i < TCACHE_BINS; ++i) {
+        tcache_flush_bin(&my_tcache->bins[i], 0);
+    }
+}
+
+/**
+ * Finishes an allocation once a block has been found: counts it for the
+ * thread, tags it with the allocation context 'ctx' (which was already charged
+ * 'charged' bytes), and returns its data.
+ */
+static void *hand_out(struct mem_block *block, size_t size, unsigned int ctx,
+        size_t charged)
+{
+    size_t usable = real_size(block->size) - sizeof(struct mem_block);
+    thread_allocated += usable;
+    set_context(block, ctx);
+    /* The block may have come out larger than asked for */
+    context_charge(ctx, usable - charged, false);
+
+    // scribble
+    char *scribble = getenv("ALLOCATOR_SCRIBBLE");
+    if (scribble != NULL) {
+        memset(block + 1, 0xAA, size);
+    }
+
+    return block + 1;
+}
+
+void *malloc_impl(size_t size, char *name)
+{
+    if (size > MAX_REQUEST) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t aligned_size = block_size(size);
+    bool dedicated = aligned_size >= mmap_threshold;
+
+    unsigned int ctx = my_context;
+    size_t charged = aligned_size - sizeof(struct mem_block);
+    if (!context_charge(ctx, charged, true)) {
+        atomic_fetch_add(&contexts[ctx].hard_denials, 1);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct perf_sample sample;
+    perf_begin(&sample);
+
+    struct tcache *cache = NULL;
+    struct mem_block *block = NULL;
+    if (!dedicated && aligned_size <= TCACHE_MAX_BLOCK) {
+        cache = thread_cache();
+    }
+    if (cache != NULL) {
+        block = tcache_get(cache, aligned_size, name);
+    }
+
+    if (block != NULL) {
+        perf_end(&sample, PERF_PATH_TCACHE);
+    } else {
+        struct arena *arena = thread_arena();
+        arena_lock(arena);
+        drain_remote(arena);
+
+        enum perf_path path = PERF_PATH_REUSE;
+        if (!dedicated || arena->critical) {
+            block = reuse(arena, aligned_size);
+        }
+        if (block == NULL && arena->critical
+                && critical_coalesce(arena) > 0) {
+            block = reuse(arena, aligned_size);
+        }
+
+        if (block == NULL && arena->critical) {
+            /* The reserve is exhausted: allocate from a regular arena
+             * instead of growing the critical one, reusing what earlier
+             * fallbacks freed there before mapping anything */
+            arena->totals.critical_fallbacks++;
+            pthread_mutex_unlock(&arena->lock);
+            if (my_fallback_arena == NULL) {
+                my_fallback_arena = round_robin_arena();
+            }
+            arena = my_fallback_arena;
+            arena_lock(arena);
+            drain_remote(arena);
+            if (!dedicated) {
+                block = reuse(arena, aligned_size);
+            }
+        }
+
+        if (block == NULL) {
+            path = PERF_PATH_MMAP;
+            block = map_region(arena, aligned_size, dedicated);
+        }
+        if (block == NULL) {
+            /* Out of memory: hand back everything caches and the region
+             * pool hold, then try once more */
+            pthread_mutex_unlock(&arena->lock);
+            allocator_trim(0);
+            arena_lock(arena);
+            if (!dedicated) {
+                block = reuse(arena, aligned_size);
+            }
+            if (block == NULL) {
+                block = map_region(arena, aligned_size, dedicated);
+            }
+        }
+        if (block == NULL) {
+            pthread_mutex_unlock(&arena->lock);
+            perf_end(&sample, path);
+            context_credit(ctx, charged);
+            /* From now on anyone may fall back on the emergency reserve */
+            atomic_store(&heap_exhausted, true);
+            atomic_fetch_add(&alloc_failures, 1);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        set_name(block, name);
+        pthread_mutex_unlock(&arena->lock);
+        perf_end(&sample, path);
+    }
+
+    if (cache != NULL) {
+        tcache_tick(cache);
+    }
+    return hand_out(block, size, ctx, charged);
+}
+
+/**
+ * Allocates like malloc_impl(), but may fall back on the emergency reserve
+ * (ALLOC_PARAM_EMERGENCY_RESERVE) as soon as memory runs out rather than only
+ * after another allocation has already failed.
+ */
+void *malloc_critical(size_t size, char *name)
+{
+    bool was_critical = my_critical_request;
+    my_critical_request = true;
+    void *ptr = malloc_impl(size, name);
+    my_critical_request = was_critical;
+    return ptr;
+}
+
+/* Blocks malloc_near() looks at on either side of its hint */
+#define NEAR_SEARCH_BLOCKS 64
+
+/**
+ * Looks for a free block of at least 'size' bytes close to 'hint' in its
+ * region's block list, stepping outward one neighbor at a time in both
+ * directions. The part of the free block nearest the hint is split off and
+ * returned marked used. Must be called with the owning arena's lock held.
+ */
+static struct mem_block *near_fit(struct mem_block *hint, size_t size)
+{
+    struct mem_block *after = hint->next_block;
+    struct mem_block *before = hint->prev_block;
+    for (int i = 0; i < NEAR_SEARCH_BLOCKS; ++i) {
+        if (after == NULL && before == NULL) {
+            break;
+        }
+
+        struct mem_block *block = NULL;
+        if (after != NULL && is_free(after)
+                && real_size(after->size) >= size) {
+            /* Keep the head, right behind the hint */
+            block = after;
+            struct mem_block *rest
+                = split_block(block, real_size(block->size) - size);
+            remove_free(block);
+            if (rest != NULL) {
+                add_free(rest);
+            }
+        } else if (before != NULL && is_free(before)
+                && real_size(before->size) >= size) {
+            /* Keep the tail, right in front of the hint */
+            block = split_block(before, size);
+            if (block == NULL) {
+                block = before;
+                remove_free(block);
+            }
+        }
+
+        if (block != NULL) {
+            set_used(block);
+            region_used(block, real_size(block->size));
+            return block;
+        }
+
+        after = after == NULL ? NULL : after->next_block;
+        before = before == NULL ? NULL : before->prev_block;
+    }
+    return NULL;
+}
+
+/**
+ * Allocates like malloc_impl(), but first tries to place the block next to
+ * 'hint' (a live block from this allocator), using free space in the hint's
+ * region within NEAR_SEARCH_BLOCKS blocks of it, so objects traversed
+ * together share cache lines and pages. The block then belongs to the hint's
+ * arena. Falls back to malloc_impl() when nothing nearby fits, the hint is
+ * NULL or a dedicated mapping, or the request is large enough for one itself.
+ */
+void *malloc_near(void *hint, size_t size, char *name)
+{
+    if (hint == NULL || size > MAX_REQUEST) {
+        return malloc_impl(size, name);
+    }
+
+    struct mem_block *hint_block = (struct mem_block *) hint - 1;
+    struct arena *arena = arena_of(hint_block);
+    size_t aligned_size = block_size(size);
+    if ((hint_block->size & BLOCK_DEDICATED) || aligned_size >= mmap_threshold
+            || (arena->critical && arena != my_arena)) {
+        return malloc_impl(size, name);
+    }
+
+    unsigned int ctx = my_context;
+    size_t charged = aligned_size - sizeof(struct mem_block);
+    if (!context_charge(ctx, charged, true)) {
+        atomic_fetch_add(&contexts[ctx].hard_denials, 1);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    arena_lock(arena);
+    struct mem_block *block = near_fit(hint_block, aligned_size);
+    if (block != NULL) {
+        set_name(block, name);
+        arena->totals.near_hits++;
+    } else {
+        arena->totals.near_misses++;
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    if (block == NULL) {
+        context_credit(ctx, charged);
+        return malloc_impl(size, name);
+    }
+    return hand_out(block, size, ctx, charged);
+}
+
+void free_impl(void *ptr)
+{
+    if (ptr == NULL) {
+        /* Freeing a NULL pointer does nothing */
+        return;
+    }
+    
+    struct mem_block *block = (struct mem_block *)ptr - 1;
+
+    if (is_free(block) || (block->size & BLOCK_PARKED)) {
+        LOG("double free detected on %p\n", ptr);
+        return;
+    }
+    size_t usable = real_size(block->size) - sizeof(struct mem_block);
+    thread_deallocated += usable;
+    context_credit(block_context(block), usable);
+
+    struct perf_sample sample;
+    perf_begin(&sample);
+    struct arena *arena = arena_of(block);
+    if (arena != my_arena) {
+        free_remote(arena, block);
+        perf_end(&sample, PERF_PATH_FREE);
+        return;
+    }
+
+    struct tcache *cache = thread_cache();
+    if (cache != NULL && tcache_put(cache, block)) {
+        perf_end(&sample, PERF_PATH_FREE);
+        tcache_tick(cache);
+        return;
+    }
+
+    arena_lock(arena);
+
+    if (block->size & BLOCK_DEDICATED) {
+        unmap_region(block);
+    } else {
+        release_block(block);
+    }
+
+    pthread_mutex_unlock(&arena->lock);
+    perf_end(&sample, PERF_PATH_FREE);
+
+    if (cache != NULL) {
+        tcache_tick(cache);
+    }
+}
+
+/**
+ * Frees every used block named 'tag' (compared as far as names are kept, see
+ * ALLOC_NAME_MAX) in one pass: each arena is locked once, and regions whose
+ * tag filter shows no block with that name are skipped without walking their
+ * blocks. Blocks already freed into a thread cache are left alone; blocks
+ * other threads allocate with the same tag while this runs may or may not be
+ * freed. The filter has 128 bits, so with many distinct tags most regions
+ * still get walked, and the cost approaches that of a heap walk.
+ *
+ * @return number of blocks freed
+ */
+size_t free_tagged(const char *tag)
+{
+    if (tag == NULL || tag[0] == '\0') {
+        return 0;
+    }
+
+    unsigned int bit = tag_bit(tag);
+    size_t freed = 0;
+    for (size_t a = 0; a < arena_span(); ++a) {
+        struct arena *arena = &arenas[a];
+        arena_lock(arena);
+
+        /* Walk the table backward: emptied regions are replaced by the last
+         * descriptor, or compacted toward the front, both already visited */
+        for (size_t i = arena->region_count; i-- > 0; ) {
+            if (i >= arena->region_count) {
+                continue;
+            }
+            struct region *region = arena->regions[i].base;
+            if (region == NULL || !(__atomic_load_n(&region->tags[bit / 64],
+                            __ATOMIC_RELAXED) & (1ULL << (bit % 64)))) {
+                continue;
+            }
+
+            struct mem_block *block = (struct mem_block *) (region + 1);
+            while (block != NULL) {
+                struct mem_block *next = block->next_block;
+                /* Pairs with the unparking in tcache_get() */
+                size_t flags = __atomic_load_n(&block->size, __ATOMIC_ACQUIRE);
+                if ((flags & (BLOCK_FREE | BLOCK_PARKED))
+                        || strncmp(block->name, tag, ALLOC_NAME_MAX) != 0) {
+                    block = next;
+                    continue;
+                }
+
+                /* A free successor gets merged into this block */
+                if (next != NULL && is_free(next)) {
+                    next = next->next_block;
+                }
+                size_t usable = real_size(block->size)
+                    - sizeof(struct mem_block);
+                thread_deallocated += usable;
+                context_credit(block_context(block), usable);
+                if (block->size & BLOCK_DEDICATED) {
+                    unmap_region(block);
+                } else {
+                    release_block(block);
+                }
+                freed++;
+                block = next;
+            }
+        }
+
+        pthread_mutex_unlock(&arena->lock);
+    }
+    return freed;
+}
+
+void *calloc_impl(size_t nmemb, size_t size, char *name)
+{
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *ptr = malloc_impl(total, name);
+    if (ptr != NULL) {
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+/**
+ * Shrinks a used block to 'size' bytes (header + data) by splitting off its end
+ * as a new free block, which is merged with a free neighbor if there is one
+ * (except in a latency-critical arena, see release_block()). Nothing happens
+ * if the leftover would be too small to hold a free block. Must be called with
+ * the lock held.
+ */
+static void split_used(struct mem_block *block, size_t size)
+{
+    size_t current = real_size(block->size);
+    if (current < size || current - size < sizeof(struct free_block)) {
+        return;
+    }
+
+    struct mem_block *leftover = (struct mem_block *) ((char *) block + size);
+    leftover->region = block->region;
+    leftover->name[0] = '\0';
+    leftover->size = current - size;
+    block->size = size | (block->size & BLOCK_FLAGS);
+    blist_insert(block, leftover);
+    region_used(block, -(ptrdiff_t) real_size(leftover->size));
+
+    add_free(leftover);
+    if (!arena_of(block)->critical) {
+        merge_block(leftover);
+    }
+}
+
+/**
+ * Shrinks a dedicated block to 'size' bytes (header + data), rounded up to
+ * whole pages, by unmapping the end of its region. Must be called with the
+ * lock held.
+ */
+static void shrink_dedicated(struct mem_block *block, size_t size)
+{
+    struct region *region = region_of(block);
+    size_t region_size = align(sizeof(struct region) + size, page_size());
+    if (region_size >= region->size) {
+        return;
+    }
+
+    size_t released = region->size - region_size;
+    if (munmap((char *) region + region_size, released) == -1) {
+        perror("munmap");
+        return;
+    }
+
+    struct arena *arena = region->arena;
+    struct region_desc *desc = region_desc_of(block);
+    block->size -= released;
+    region->size = region_size;
+    desc->size = region_size;
+    desc->used_bytes -= released;
+    arena->totals.mapped_bytes -= released;
+    arena->totals.dedicated_bytes -= released;
+    arena->totals.munmap_count++;
+}
+
+/**
+ * Grows a used block to at least 'size' bytes (header + data) by absorbing the
+ * free block that follows it in the same region. Any excess is split back off.
+ * Must be called with the lock held.
+ *
+ * @return true if the block now holds 'size' bytes, false if it can't grow
+ */
+static bool grow_in_place(struct mem_block *block, size_t size)
+{
+    size_t current = real_size(block->size);
+    if (size <= current) {
+        return true;
+    }
+
+    struct mem_block *next = block->next_block;
+    if ((block->size & BLOCK_DEDICATED) || next == NULL
+            || next->region != block->region || !is_free(next)
+            || current + real_size(next->size) < size) {
+        return false;
+    }
+
+    remove_free(next);
+    blist_remove(next);
+    block->size += real_size(next->size);
+    region_used(block, real_size(next->size));
+    split_used(block, size);
+    return true;
+}
+
+/**
+ * Blocks that have been grown by realloc_impl() keep the size the caller last
+ * asked for in their final word, which lets later reallocs copy only the live
+ * payload and tell how much copying the reserved slack saved.
+ */
+static size_t *grown_tail(struct mem_block *block)
+{
+    return (size_t *) ((char *) block + real_size(block->size)) - 1;
+}
+
+/**
+ * Counts a block resized in place as freeing its old usable size and
+ * allocating its new one, like a realloc that moves the block would, and
+ * settles its context's charge given the 'charged' bytes taken up front.
+ */
+static void count_resize(struct mem_block *block, size_t old_size,
+        size_t charged)
+{
+    size_t new_size = real_size(block->size);
+    if (old_size != new_size) {
+        thread_deallocated += old_size - sizeof(struct mem_block);
+        thread_allocated += new_size - sizeof(struct mem_block);
+    }
+
+    unsigned int ctx = block_context(block);
+    if (new_size >= old_size + charged) {
+        context_charge(ctx, new_size - old_size - charged, false);
+    } else {
+        context_credit(ctx, old_size + charged - new_size);
+    }
+}
+
+void *realloc_impl(void *ptr, size_t size, char *name)
+{
+    if (ptr == NULL) {
+        /* If the pointer is NULL, then we simply malloc a new block */
+        return malloc_impl(size, name);
+    }
+
+    if (size == 0) {
+        /* Realloc to 0 is often the same as freeing the memory block... But the
+         * C standard doesn't require this. We will free the block and return
+         * NULL here. */
+        free_impl(ptr);
+        return NULL;
+    }
+
+    if (size > MAX_REQUEST - sizeof(size_t)) {
+        /* Leave room for the grown block tail word */
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct mem_block *block = (struct mem_block *) ptr - 1;
+    struct arena *arena = arena_of(block);
+    bool grown = (block->size & BLOCK_GROWN) == BLOCK_GROWN;
+    size_t capacity = real_size(block->size) - sizeof(struct mem_block);
+    size_t live = capacity;
+    if (grown) {
+        capacity -= sizeof(size_t);
+        live = *grown_tail(block);
+    }
+
+    size_t old_size = real_size(block->size);
+    if (size <= capacity) {
+        /* The existing block is already large enough */
+        arena_lock(arena);
+        bool dedicated = (block->size & BLOCK_DEDICATED) == BLOCK_DEDICATED;
+        if (grown && size < capacity / REALLOC_SHRINK_RATIO) {
+            /* It has stopped growing: drop the slack along with the tail */
+            block->size &= ~BLOCK_GROWN;
+            if (dedicated) {
+                shrink_dedicated(block, block_size(size));
+            } else {
+                split_used(block, block_size(size));
+            }
+        } else if (grown) {
+            if (size > live) {
+                arena->totals.realloc_slack_hits++;
+                arena->totals.realloc_avoided_bytes += live;
+            }
+            *grown_tail(block) = size;
+        } else if (!dedicated) {
+            /* Give back the end of the block if it's shrinking */
+            split_used(block, block_size(size));
+        }
+        pthread_mutex_unlock(&arena->lock);
+        count_resize(block, old_size, 0);
+        return ptr;
+    }
+
+    /*
+     * The first growth allocates exactly what was asked for (plus the tail
+     * word). Once a block has grown before, it's likely to keep growing, so
+     * reserve geometric slack: N small reallocs then cost O(log N) copies.
+     */
+    size_t request = size;
+    if (grown) {
+        size_t slack = capacity < REALLOC_MAX_SLACK ? capacity : REALLOC_MAX_SLACK;
+        if (capacity + slack > request) {
+            request = capacity + slack;
+        }
+    }
+
+    /* Try to grow into the free block that follows before moving anything,
+     * as long as the block's context has room for at least the bare size */
+    size_t charged = block_size(size + sizeof(size_t)) - old_size;
+    bool fits = context_charge(block_context(block), charged, true);
+    arena_lock(arena);
+    if (fits && (grow_in_place(block, block_size(request + sizeof(size_t)))
+            || grow_in_place(block, block_size(size + sizeof(size_t))))) {
+        block->size |= BLOCK_GROWN;
+        *grown_tail(block) = size;
+        arena->totals.realloc_in_place++;
+        arena->totals.realloc_avoided_bytes += live;
+        pthread_mutex_unlock(&arena->lock);
+        count_resize(block, old_size, charged);
+        return ptr;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    if (fits) {
+        context_credit(block_context(block), charged);
+    }
+
+    /* A moved block stays in its original context */
+    uint16_t thread_context = my_context;
+    my_context = block_context(block);
+    void *new_ptr = malloc_impl(request + sizeof(size_t), name);
+    my_context = thread_context;
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+
+    size_t copy = live < size ? live : size;
+    memcpy(new_ptr, ptr, copy);
+
+    struct mem_block *new_block = (struct mem_block *) new_ptr - 1;
+    struct arena *new_arena = arena_of(new_block);
+    arena_lock(new_arena);
+    new_block->size |= BLOCK_GROWN;
+    *grown_tail(new_block) = size;
+    new_arena->totals.realloc_copies++;
+    new_arena->totals.realloc_copied_bytes += copy;
+    pthread_mutex_unlock(&new_arena->lock);
+
+    free_impl(ptr);
+    return new_ptr;
+}
+
+/**
+ * Resizes an array of 'nmemb' elements of 'size' bytes each, failing with
+ * ENOMEM (and leaving the original block untouched) if the total overflows.
+ */
+void *reallocarray_impl(void *ptr, size_t nmemb, size_t size, char *name)
+{
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc_impl(ptr, total, name);
+}
+
+/**
+ * Formats output straight to stdout without going through stdio's buffers,
+ * which may need to allocate memory while we are holding the allocator lock.
+ */
+static void print_out(const char *fmt, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (len < 0) {
+        return;
+    } else if ((size_t) len >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+
+    ssize_t written = 0;
+    while (written < len) {
+        ssize_t w = write(STDOUT_FILENO, buf + written, len - written);
+        if (w <= 0) {
+            return;
+        }
+        written += w;
+    }
+}
+
+/**
+ * Adds the counters of one arena to a snapshot.
+ */
+static void add_totals(struct alloc_stats *stats, struct alloc_stats *totals)
+{
+    stats->mapped_bytes += totals->mapped_bytes;
+    stats->regions += totals->regions;
+    stats->dedicated_bytes += totals->dedicated_bytes;
+    stats->dedicated_regions += totals->dedicated_regions;
+    stats->mmap_count += totals->mmap_count;
+    stats->munmap_count += totals->munmap_count;
+    stats->max_dedicated_regions += totals->max_dedicated_regions;
+    stats->max_dedicated_bytes += totals->max_dedicated_bytes;
+    stats->minor_faults += totals->minor_faults;
+    stats->major_faults += totals->major_faults;
+    stats->realloc_copies += totals->realloc_copies;
+    stats->realloc_copied_bytes += totals->realloc_copied_bytes;
+    stats->realloc_in_place += totals->realloc_in_place;
+    stats->realloc_slack_hits += totals->realloc_slack_hits;
+    stats->realloc_avoided_bytes += totals->realloc_avoided_bytes;
+    stats->near_hits += totals->near_hits;
+    stats->near_misses += totals->near_misses;
+    stats->remote_frees += totals->remote_frees;
+    stats->critical_reserved_bytes += totals->critical_reserved_bytes;
+    stats->critical_locked_bytes += totals->critical_locked_bytes;
+    stats->critical_fallbacks += totals->critical_fallbacks;
+    stats->lock_contentions += totals->lock_contentions;
+    stats->lock_wait_ns += totals->lock_wait_ns;
+}
+
+/*
+ * Heap walks split each arena's region table into contiguous slices, one per
+ * walker thread. Every walker formats its output and counts its blocks into
+ * buffers of its own; once the arena is done they are written out and merged
+ * in slice order, so the result matches a serial walk. Small heaps are walked
+ * by the calling thread alone.
+ */
+#define WALK_MAX_THREADS 16
+#define WALK_REGIONS_PER_THREAD 32
+
+#define WALK_DRAIN  0x01 /* release pending remote frees first */
+#define WALK_TOTALS 0x02 /* add each arena's counters to the merged stats */
+#define WALK_LOCAL  0x04 /* stay on the calling thread, which never allocates */
+
+struct walk_text {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+struct walk_pool;
+
+struct walker {
+    struct walk_pool *pool;
+    size_t first;
+    size_t last;
+    struct walk_text text;
+    struct alloc_stats stats;
+    pthread_t thread;
+};
+
+typedef void (*walk_fn)(struct walker *walker, struct region_desc *desc);
+
+struct walk_pool {
+    walk_fn visit;
+    struct arena *arena;
+    size_t arena_index;
+    int threads;
+
+    /* Each arena is a new generation; workers wait for it to change */
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    size_t generation;
+    int pending;
+
+    struct walker walkers[WALK_MAX_THREADS];
+};
+
+/**
+ * Appends formatted output to a walker's text buffer, which is mapped directly
+ * since walkers run while arena locks are held.
+ */
+static void walk_printf(struct walker *walker, const char *fmt, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (len < 0) {
+        return;
+    } else if ((size_t) len >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+
+    struct walk_text *text = &walker->text;
+    if (text->len + len > text->capacity) {
+        size_t capacity = text->capacity == 0
+            ? 16 * page_size() : text->capacity * 2;
+        void *data = text->data == NULL
+            ? mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+            : mremap(text->data, text->capacity, capacity, MREMAP_MAYMOVE);
+        if (data == MAP_FAILED) {
+            return;
+        }
+        text->data = data;
+        text->capacity = capacity;
+    }
+    memcpy(text->data + text->len, buf, len);
+    text->len += len;
+}
+
+static void walk_text_flush(struct walk_text *text)
+{
+    size_t written = 0;
+    while (written < text->len) {
+        ssize_t w = write(STDOUT_FILENO, text->data + written,
+                text->len - written);
+        if (w <= 0) {
+            break;
+        }
+        written += w;
+    }
+    text->len = 0;
+}
+
+/**
+ * Adds the block counts one walker gathered to the merged stats.
+ */
+static void merge_walk_stats(struct alloc_stats *stats,
+        struct alloc_stats *walked)
+{
+    stats->used_blocks += walked->used_blocks;
+    stats->used_bytes += walked->used_bytes;
+    stats->free_blocks += walked->free_blocks;
+    stats->free_bytes += walked->free_bytes;
+    stats->parked_blocks += walked->parked_blocks;
+    stats->parked_bytes += walked->parked_bytes;
+    stats->resident_bytes += walked->resident_bytes;
+    stats->free_resident_bytes += walked->free_resident_bytes;
+    for (int i = 0; i < ALLOC_SIZE_CLASSES; ++i) {
+        stats->classes[i].blocks += walked->classes[i].blocks;
+        stats->classes[i].bytes += walked->classes[i].bytes;
+        stats->classes[i].resident_bytes += walked->classes[i].resident_bytes;
+    }
+    memset(walked, 0, sizeof(*walked));
+}
+
+static void walk_slice(struct walker *walker)
+{
+    struct walk_pool *pool = walker->pool;
+    for (size_t r = walker->first; r < walker->last; ++r) {
+        struct region_desc *desc = &pool->arena->regions[r];
+        if (desc->base != NULL) {
+            pool->visit(walker, desc);
+        }
+    }
+}
+
+static void *walk_worker_run(void *arg)
+{
+    struct walker *walker = arg;
+    struct walk_pool *pool = walker->pool;
+    size_t seen = 0;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        seen = pool->generation;
+        struct arena *arena = pool->arena;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (arena == NULL) {
+            return NULL;
+        }
+        walk_slice(walker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * Picks the number of walker threads: one per WALK_REGIONS_PER_THREAD regions,
+ * capped by ALLOC_PARAM_WALK_THREADS (or the CPU count).
+ */
+static int walk_thread_count(void)
+{
+    size_t regions = 0;
+    for (size_t i = 0; i < arena_span(); ++i) {
+        regions += atomic_load_explicit(
+                (_Atomic size_t *) &arenas[i].region_count,
+                memory_order_relaxed);
+    }
+
+    size_t limit = walk_threads;
+    if (limit == 0) {
+        cpu_set_t cpus;
+        limit = sched_getaffinity(0, sizeof(cpus), &cpus) == 0
+            ? CPU_COUNT(&cpus) : 1;
+    }
+    if (limit > WALK_MAX_THREADS) {
+        limit = WALK_MAX_THREADS;
+    }
+
+    size_t threads = regions / WALK_REGIONS_PER_THREAD;
+    if (threads > limit) {
+        threads = limit;
+    }
+    return threads > 0 ? threads : 1;
+}
+
+/**
+ * Walks every region of every arena with 'visit', spreading each arena's
+ * regions over a pool of walker threads. An arena's lock is held only while
+ * its own regions are walked and their output written; walked block counts
+ * are merged into 'stats'. The workers are started before any lock is taken,
+ * since creating a thread may allocate.
+ */
+static void heap_walk(walk_fn visit, int flags, struct alloc_stats *stats)
+{
+    struct walk_pool pool = {
+        .visit = visit,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .start = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+    };
+
+    int threads = (flags & WALK_LOCAL) ? 1 : walk_thread_count();
+    pool.threads = 1;
+    for (int i = 0; i < threads; ++i) {
+        pool.walkers[i].pool = &pool;
+    }
+    for (int i = 1; i < threads; ++i) {
+        if (pthread_create(&pool.walkers[i].thread, NULL, walk_worker_run,
+                    &pool.walkers[i]) != 0) {
+            break;
+        }
+        pool.threads++;
+    }
+
+    for (size_t i = 0; i < arena_span(); ++i) {
+        struct arena *arena = &arenas[i];
+        arena_lock(arena);
+        if (flags & WALK_DRAIN) {
+            drain_remote(arena);
+        }
+        if (flags & WALK_TOTALS) {
+            add_totals(stats, &arena->totals);
+            stats->remote_pending += lfstack_length(&arena->remote_frees);
+        }
+
+        /* Contiguous slices keep the merged output in region order */
+        size_t count = arena->region_count;
+        for (int w = 0; w < pool.threads; ++w) {
+            pool.walkers[w].first = count * w / pool.threads;
+            pool.walkers[w].last = count * (w + 1) / pool.threads;
+        }
+
+        pool.arena = arena;
+        pool.arena_index = i;
+        if (pool.threads > 1 && count > 1) {
+            pthread_mutex_lock(&pool.lock);
+            pool.pending = pool.threads - 1;
+            pool.generation++;
+            pthread_cond_broadcast(&pool.start);
+            pthread_mutex_unlock(&pool.lock);
+
+            walk_slice(&pool.walkers[0]);
+
+            pthread_mutex_lock(&pool.lock);
+            while (pool.pending > 0) {
+                pthread_cond_wait(&pool.done, &pool.lock);
+            }
+            pthread_mutex_unlock(&pool.lock);
+        } else {
+            pool.walkers[0].first = 0;
+            pool.walkers[0].last = count;
+            for (int w = 1; w < pool.threads; ++w) {
+                pool.walkers[w].first = pool.walkers[w].last = 0;
+            }
+            walk_slice(&pool.walkers[0]);
+        }
+
+        for (int w = 0; w < pool.threads; ++w) {
+            walk_text_flush(&pool.walkers[w].text);
+            merge_walk_stats(stats, &pool.walkers[w].stats);
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.arena = NULL;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int w = 0; w < pool.threads; ++w) {
+        if (w > 0) {
+            pthread_join(pool.walkers[w].thread, NULL);
+        }
+        if (pool.walkers[w].text.data != NULL) {
+            munmap(pool.walkers[w].text.data, pool.walkers[w].text.capacity);
+        }
+    }
+}
+
+/**
+ * Samples a region's residency and prints it along with each of its blocks.
+ */
+static void print_region(struct walker *walker, struct region_desc *desc)
+{
+    struct resident_window window;
+    struct region *region = desc->base;
+    resident_window_init(&window, region);
+    desc->resident = resident_bytes(&window, (uintptr_t) region,
+            (uintptr_t) region + region->size);
+    walk_printf(walker, "[REGION %p] arena %zu, %zu mapped, %zu resident, "
+            "%zu minor / %zu major faults\n",
+            region + 1, walker->pool->arena_index, region->size,
+            desc->resident, region->minor_faults, region->major_faults);
+
+    struct mem_block *block = (struct mem_block *) (region + 1);
+    for (; block != NULL; block = block->next_block) {
+        size_t size = real_size(block->size);
+        walk_printf(walker, "  [BLOCK %p-%p] %-7zu [%s]  '%s'\n",
+                block, (char *) block + size, size,
+                is_free(block) ? "FREE"
+                : (block->size & BLOCK_PARKED) ? "PARKED" : "USED",
+                block->name);
+        if (!is_free(block) && !(block->size & BLOCK_PARKED)) {
+            struct alloc_class_stats *class
+                = &walker->stats.classes[alloc_size_class(size)];
+            class->blocks++;
+            class->bytes += size;
+            class->resident_bytes += resident_bytes(&window,
+                    (uintptr_t) block, (uintptr_t) block + size);
+        }
+    }
 }
 
 /**
@@ -478,20 +2613,74 @@ void *realloc_impl(void *ptr, size_t size, char *name)
  */
 void print_memory(void)
 {
-    // TODO implement memory printout
-    puts("-- Current Memory State --\n");
-    // struct mem_block *mem = blist_head;
-    // while (mem != NULL) {
-    //     printf("[REGION %p]\n", mem->region);
-    // }
-    
-    puts("-- Free List --");
-    // struct free_block *free = free_head;
-    // while (free != NULL) {
-    //     printf("[%p] -> ", free);
-    //     free = free->next_free;
-    // }
-    puts("NULL");
+    fflush(stdout);
+    tcache_flush_self();
+
+    struct alloc_stats walked = { 0 };
+    struct alloc_class_stats *classes = walked.classes;
+
+    print_out("-- Current Memory State --\n");
+    heap_walk(print_region, WALK_DRAIN, &walked);
+
+    print_out("\n-- Size Classes --\n");
+    for (int i = 0; i < ALLOC_SIZE_CLASSES; ++i) {
+        if (classes[i].blocks == 0) {
+            continue;
+        }
+        size_t lower = i == 0 ? 0 : alloc_size_class_limit(i - 1) + 1;
+        if (i == ALLOC_SIZE_CLASSES - 1) {
+            print_out("[CLASS %zu+] ", lower);
+        } else {
+            print_out("[CLASS %zu-%zu] ", lower, alloc_size_class_limit(i));
+        }
+        print_out("%zu blocks, %zu mapped, %zu resident\n",
+                classes[i].blocks, classes[i].bytes,
+                classes[i].resident_bytes);
+    }
+
+    print_out("\n-- Free List --\n");
+    for (size_t i = 0; i < arena_span(); ++i) {
+        struct arena *arena = &arenas[i];
+        arena_lock(arena);
+
+        struct free_block *free = arena->free_head;
+        if (i > 0 && free == NULL) {
+            pthread_mutex_unlock(&arena->lock);
+            continue;
+        }
+        while (free != NULL) {
+            print_out("[%p] -> ", free);
+            free = free->next_free;
+        }
+        print_out("NULL\n");
+
+        pthread_mutex_unlock(&arena->lock);
+    }
+    if (arena_count == 0) {
+        print_out("NULL\n");
+    }
+}
+
+/**
+ * Prints and counts the blocks of a region that are still in use.
+ */
+static void leak_region(struct walker *walker, struct region_desc *desc)
+{
+    if (desc->used_bytes == 0) {
+        return;
+    }
+
+    struct mem_block *block = (struct mem_block *) (desc->base + 1);
+    for (; block != NULL; block = block->next_block) {
+        if (is_free(block) || (block->size & BLOCK_PARKED)) {
+            continue;
+        }
+        size_t size = real_size(block->size);
+        walk_printf(walker, "[BLOCK %p] %-7zu '%s'\n", block, size,
+                block->name);
+        walker->stats.used_blocks++;
+        walker->stats.used_bytes += size;
+    }
 }
 
 /**
@@ -512,6 +2701,598 @@ void print_memory(void)
  */
 bool leak_check(void)
 {
+    fflush(stdout);
+    tcache_flush_self();
+
+    struct alloc_stats lost = { 0 };
+
+    print_out("-- Leak Check --\n");
+    heap_walk(leak_region, WALK_DRAIN, &lost);
+
+    print_out("\n-- Summary --\n");
+    print_out("%zu blocks lost (%zu bytes)\n", lost.used_blocks,
+            lost.used_bytes);
+
+    return lost.used_blocks > 0;
+}
+
+/**
+ * Counts the blocks of a region by state and samples their residency. Byte
+ * totals come straight from the descriptor; parked blocks count as in use
+ * there but are reported separately.
+ */
+static void stats_region(struct walker *walker, struct region_desc *desc)
+{
+    struct alloc_stats *stats = &walker->stats;
+    struct resident_window window;
+    struct region *region = desc->base;
+    struct mem_block *block = (struct mem_block *) (region + 1);
+    resident_window_init(&window, region);
+    desc->resident = resident_bytes(&window,
+            (uintptr_t) region, (uintptr_t) block);
+
+    size_t parked = 0;
+    for (; block != NULL; block = block->next_block) {
+        size_t size = real_size(block->size);
+        size_t resident = resident_bytes(&window,
+                (uintptr_t) block, (uintptr_t) block + size);
+        desc->resident += resident;
+
+        if (is_free(block)) {
+            stats->free_blocks++;
+            stats->free_resident_bytes += resident;
+        } else if (block->size & BLOCK_PARKED) {
+            stats->parked_blocks++;
+            parked += size;
+        } else {
+            struct alloc_class_stats *class
+                = &stats->classes[alloc_size_class(size)];
+            stats->used_blocks++;
+            class->blocks++;
+            class->bytes += size;
+            class->resident_bytes += resident;
+        }
+    }
+
+    stats->free_bytes += desc->free_bytes;
+    stats->used_bytes += desc->used_bytes - parked;
+    stats->parked_bytes += parked;
+    stats->resident_bytes += desc->resident;
+}
+
+static void collect_stats(struct alloc_stats *stats, int flags)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->arenas = arena_count + critical_count;
+    stats->critical_arenas = critical_count;
+
+    heap_walk(stats_region, WALK_TOTALS | flags, stats);
+
+    /* Pooled regions are still mapped, they just don't belong to an arena */
+    stats->retained_bytes = atomic_load(&pool_bytes);
+    stats->retained_regions = lfstack_length(&pool);
+    stats->region_steals = atomic_load(&pool_steals);
+    struct region *reserve = atomic_load(&emergency);
+    stats->emergency_reserved_bytes = reserve == NULL ? 0 : reserve->size;
+    stats->emergency_releases = atomic_load(&emergency_releases);
+    stats->alloc_failures = atomic_load(&alloc_failures);
+    stats->mapped_bytes += stats->emergency_reserved_bytes;
+    stats->mapped_bytes += stats->retained_bytes;
+    stats->regions += stats->retained_regions;
+    stats->munmap_count += atomic_load(&pool_munmaps);
+
+    stats->tcache_hits = atomic_load(&tcache_hits);
+    stats->tcache_misses = atomic_load(&tcache_misses);
+    stats->tcache_overflows = atomic_load(&tcache_overflows);
+    stats->tcache_grows = atomic_load(&tcache_grows);
+    stats->tcache_shrinks = atomic_load(&tcache_shrinks);
+    stats->tcache_budget_denials = atomic_load(&tcache_denials);
+    stats->tcache_capacity_bytes = atomic_load(&tcache_capacity);
+}
+
+/**
+ * Fills in a snapshot of the allocator's current state. Each arena is locked
+ * only while its own blocks are being counted (see heap_walk()).
+ */
+void allocator_stats(struct alloc_stats *stats)
+{
+    collect_stats(stats, 0);
+}
+
+/**
+ * Like allocator_stats(), but the heap is walked by the calling thread alone.
+ * Starting walker threads allocates, so monitoring code that must not touch
+ * the heap it measures uses this instead.
+ */
+void allocator_stats_local(struct alloc_stats *stats)
+{
+    collect_stats(stats, WALK_LOCAL);
+}
+
+/**
+ * Returns memory held by the allocator to the OS: pending remote frees are
+ * released, empty regions in the pool are unmapped (keeping at most 'pad'
+ * bytes of them for reuse), and the whole pages inside free blocks are
+ * discarded with madvise(MADV_DONTNEED) so they no longer count toward the
+ * resident set.
+ *
+ * @return number of bytes unmapped or purged
+ */
+size_t allocator_trim(size_t pad)
+{
+    size_t released = 0;
+
+    tcache_flush_self();
+
+    for (size_t i = 0; i < arena_span(); ++i) {
+        struct arena *arena = &arenas[i];
+        arena_lock(arena);
+        drain_remote(arena);
+
+        if (arena->critical) {
+            /* Reserved pages stay resident; just catch up on merging */
+            critical_coalesce(arena);
+            pthread_mutex_unlock(&arena->lock);
+            continue;
+        }
+
+        struct free_block *free = arena->free_head;
+        while (free != NULL) {
+            /* Leave the header and free list links intact */
+            uintptr_t start = align((uintptr_t) (free + 1), page_size());
+            uintptr_t end = ((uintptr_t) free + real_size(free->block.size))
+                & ~(page_size() - 1);
+            if (end > start && madvise((void *) start, end - start,
+                        MADV_DONTNEED) == 0) {
+                released += end - start;
+            }
+            free = free->next_free;
+        }
+
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+
+    /* Take the whole pool, then wait until no pop can still be reading the
+     * link of a region we're about to unmap. Remote frees were released
+     * first so any regions they emptied are in the pool by now. */
+    struct lfstack_node *pooled = lfstack_take_all(&pool);
+    lfstack_quiesce(&pool);
+
+    size_t kept = 0;
+    while (pooled != NULL) {
+        struct lfstack_node *next = pooled->next;
+        struct region *region = pool_region(pooled);
+        atomic_fetch_sub(&pool_bytes, region->size);
+        if (kept + region->size <= pad) {
+            kept += region->size;
+            pool_push(region);
+        } else {
+            released += region->size;
+            unmap_pooled(region);
+        }
+        pooled = next;
+    }
+
+    return released;
+}
+
+/* Where an unnamed block keeps its allocation site, past the empty name */
+#define SITE_OFFSET 8
+
+static void *block_site(struct mem_block *block)
+{
+    if (block->name[0] != '\0') {
+        return NULL;
+    }
+    void *site;
+    memcpy(&site, block->name + SITE_OFFSET, sizeof(site));
+    return site;
+}
+
+/**
+ * Records the code address that allocated 'ptr' so heap walks can group
+ * unnamed blocks by allocation site. Named blocks keep their name instead.
+ */
+void allocator_set_site(void *ptr, void *site)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    struct mem_block *block = (struct mem_block *) ptr - 1;
+    if (block->name[0] == '\0') {
+        memcpy(block->name + SITE_OFFSET, &site, sizeof(site));
+    }
+}
+
+static struct alloc_block_info block_info(struct mem_block *block,
+        size_t arena, struct region *region)
+{
+    return (struct alloc_block_info) {
+        .ptr = block + 1,
+        .size = real_size(block->size),
+        .state = is_free(block) ? ALLOC_BLOCK_FREE
+            : (block->size & BLOCK_PARKED) ? ALLOC_BLOCK_PARKED
+            : ALLOC_BLOCK_USED,
+        .name = block->name,
+        .site = is_free(block) ? NULL : block_site(block),
+        .arena = arena,
+        .context = is_free(block) ? 0 : block_context(block),
+        .region = region,
+        .region_size = region->size,
+    };
+}
+
+/**
+ * Calls 'visit' for every block in the heap, one arena at a time with that
+ * arena's lock held, so the callback must not allocate or free through this
+ * allocator. The calling thread's cache and pending remote frees are released
+ * first so freed blocks are reported as free.
+ */
+void allocator_walk(
+        void (*visit)(const struct alloc_block_info *info, void *arg),
+        void *arg)
+{
+    tcache_flush_self();
+
+    for (size_t i = 0; i < arena_span(); ++i) {
+        struct arena *arena = &arenas[i];
+        arena_lock(arena);
+        drain_remote(arena);
+
+        for (size_t r = 0; r < arena->region_count; ++r) {
+            struct region *region = arena->regions[r].base;
+            if (region == NULL) {
+                continue;
+            }
+            struct mem_block *block = (struct mem_block *) (region + 1);
+            for (; block != NULL; block = block->next_block) {
+                struct alloc_block_info info = block_info(block, i, region);
+                visit(&info, arg);
+            }
+        }
+
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+/**
+ * Calls 'visit' for every region in the heap with its mapped and resident
+ * bytes, occupancy, and page faults, one arena at a time with that arena's
+ * lock held (so the callback must not allocate or free through this
+ * allocator). Residency is sampled with mincore() as each region is visited.
+ */
+void allocator_walk_regions(
+        void (*visit)(const struct alloc_region_info *info, void *arg),
+        void *arg)
+{
+    tcache_flush_self();
+
+    for (size_t i = 0; i < arena_span(); ++i) {
+        struct arena *arena = &arenas[i];
+        arena_lock(arena);
+        drain_remote(arena);
+
+        for (size_t r = 0; r < arena->region_count; ++r) {
+            struct region_desc *desc = &arena->regions[r];
+            struct region *region = desc->base;
+            if (region == NULL) {
+                continue;
+            }
+
+            struct resident_window window;
+            resident_window_init(&window, region);
+            desc->resident = resident_bytes(&window, (uintptr_t) region,
+                    (uintptr_t) region + region->size);
+            struct mem_block *first = (struct mem_block *) (region + 1);
+            struct alloc_region_info info = {
+                .region = region,
+                .arena = i,
+                .mapped_bytes = region->size,
+                .resident_bytes = desc->resident,
+                .used_bytes = desc->used_bytes,
+                .free_bytes = desc->free_bytes,
+                .blocks = desc->blocks,
+                .minor_faults = region->minor_faults,
+                .major_faults = region->major_faults,
+                .dedicated = (first->size & BLOCK_DEDICATED) != 0,
+            };
+            visit(&info, arg);
+        }
+
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+/**
+ * Starts an incremental heap iteration. Until allocator_iterate_end() is
+ * called, regions unmapped by any thread keep their slot in the region table
+ * (as a hole), so a cursor paused between chunks never skips or repeats a
+ * region that stays mapped.
+ */
+void allocator_iterate_begin(struct alloc_cursor *cursor)
+{
+    *cursor = (struct alloc_cursor) { 0 };
+    atomic_fetch_add(&active_iterators, 1);
+    tcache_flush_self();
+}
+
+/**
+ * Reports up to 'max_blocks' blocks of one arena, resuming at the cursor. If
+ * the region's blocks were split or merged since, the recorded block may be
+ * gone; blocks within a region are kept in address order, so the first block
+ * at or past its address is where the last chunk stopped. Must be called with
+ * the arena's lock held.
+ */
+static size_t iterate_arena(struct alloc_cursor *cursor, struct arena *arena,
+        size_t max_blocks,
+        void (*visit)(const struct alloc_block_info *info, void *arg),
+        void *arg)
+{
+    size_t visited = 0;
+    for (; cursor->slot < arena->region_count; ++cursor->slot) {
+        struct region *region = arena->regions[cursor->slot].base;
+        if (region == NULL) {
+            cursor->next = 0;
+            continue;
+        }
+
+        struct region_desc *desc = &arena->regions[cursor->slot];
+        struct mem_block *block = (struct mem_block *) (region + 1);
+        if (cursor->next != 0 && desc->version == cursor->version) {
+            /* No block boundaries moved, so the header is still there */
+            block = (struct mem_block *) cursor->next;
+        } else {
+            while (block != NULL && (uintptr_t) block < cursor->next) {
+                block = block->next_block;
+            }
+        }
+        for (; block != NULL; block = block->next_block) {
+            if (visited == max_blocks) {
+                cursor->next = (uintptr_t) block;
+                cursor->version = desc->version;
+                return visited;
+            }
+            struct alloc_block_info info
+                = block_info(block, cursor->arena, region);
+            visit(&info, arg);
+            visited++;
+        }
+        cursor->next = 0;
+    }
+
+    cursor->arena++;
+    cursor->slot = 0;
+    return visited;
+}
+
+/**
+ * Calls 'visit' for up to 'max_blocks' more blocks of the heap, then records
+ * where it stopped in the cursor. Arena locks are only held for the duration
+ * of the call, so other threads keep allocating between chunks: blocks they
+ * allocate or free in the meantime may or may not be reported, but blocks
+ * that exist throughout are reported exactly once. As with allocator_walk(),
+ * 'visit' must not allocate or free through this allocator.
+ *
+ * @return number of blocks visited; 0 once the iteration is complete
+ */
+size_t allocator_iterate(struct alloc_cursor *cursor, size_t max_blocks,
+        void (*visit)(const struct alloc_block_info *info, void *arg),
+        void *arg)
+{
+    size_t visited = 0;
+    while (!cursor->done && visited < max_blocks) {
+        if (cursor->arena >= arena_span()) {
+            cursor->done = true;
+            break;
+        }
+
+        struct arena *arena = &arenas[cursor->arena];
+        arena_lock(arena);
+        drain_remote(arena);
+        visited += iterate_arena(cursor, arena, max_blocks - visited,
+                visit, arg);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    return visited;
+}
+
+/**
+ * Finishes an iteration. The last one to finish compacts the holes left in
+ * the region tables while iterations were running.
+ */
+void allocator_iterate_end(struct alloc_cursor *cursor)
+{
+    cursor->done = true;
+    if (atomic_fetch_sub(&active_iterators, 1) != 1) {
+        return;
+    }
+
+    for (size_t i = 0; i < arena_span(); ++i) {
+        struct arena *arena = &arenas[i];
+        arena_lock(arena);
+        if (arena->region_holes > 0 && atomic_load(&active_iterators) == 0) {
+            region_table_compact(arena);
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+/**
+ * Adjusts one of the allocator's tunable parameters.
+ *
+ * @return true if the parameter was updated, false if it is not supported
+ */
+bool allocator_set_param(enum alloc_param param, size_t value)
+{
+    switch (param) {
+        case ALLOC_PARAM_MMAP_THRESHOLD:
+            mmap_threshold = value;
+            return true;
+        case ALLOC_PARAM_TRIM_THRESHOLD:
+            trim_threshold = value;
+            return true;
+        case ALLOC_PARAM_TOP_PAD:
+            top_pad = value;
+            return true;
+        case ALLOC_PARAM_TCACHE_BUDGET:
+            tcache_budget = value;
+            return true;
+        case ALLOC_PARAM_WALK_THREADS:
+            walk_threads = value;
+            return true;
+        case ALLOC_PARAM_REGION_MAX:
+            region_max = value;
+            return true;
+        case ALLOC_PARAM_EMERGENCY_RESERVE:
+            emergency_size = value;
+            emergency_release();
+            emergency_refill();
+            return value == 0 || atomic_load(&emergency) != NULL;
+        case ALLOC_PARAM_ARENA_MAX:
+            if (value == 0 || value > ALLOC_MAX_ARENAS) {
+                return false;
+            }
+            /* Threads that already picked an arena keep using it */
+            arena_limit = value;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Marks the calling thread latency-critical. The first call binds it to an
+ * arena of its own, which no other thread allocates from, and every call adds
+ * a region of 'reserve_bytes' to that arena's reserve (0 adds none). The
+ * reserve is faulted in and locked up front; mallocs are served from it
+ * without mapping memory, frees go straight onto the free list without
+ * merging, and merging happens only when a malloc finds no fit or on
+ * allocator_trim(). Requests the reserve can't satisfy fall back to a regular
+ * arena (counted in critical_fallbacks). Blocks the thread allocated before
+ * the call stay in their old arena; the critical arena and its reserve outlive
+ * the thread.
+ *
+ * @return false if no critical arena is left or the reserve can't be mapped
+ */
+bool allocator_set_latency_critical(size_t reserve_bytes)
+{
+    if (reserve_bytes > MAX_REQUEST) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    struct arena *arena = my_arena;
+    if (arena == NULL || !arena->critical) {
+        size_t count = critical_count;
+        do {
+            if (count == ALLOC_MAX_CRITICAL_ARENAS) {
+                errno = EAGAIN;
+                return false;
+            }
+        } while (!atomic_compare_exchange_weak(&critical_count, &count,
+                    count + 1));
+        arena = &arenas[ALLOC_MAX_ARENAS + count];
+    }
+
+    arena_lock(arena);
+    arena->critical = true;
+    bool reserved = reserve_bytes == 0 || reserve_region(arena, reserve_bytes);
+    pthread_mutex_unlock(&arena->lock);
+    if (!reserved) {
+        return false;
+    }
+
+    if (my_arena != arena) {
+        /* Cached blocks belong to the old arena */
+        tcache_flush_self();
+        my_arena = arena;
+    }
+    return true;
+}
+
+/**
+ * Returns a pointer to the calling thread's running total of usable bytes
+ * allocated (malloc, calloc, and realloc, including in-place resizes). The
+ * pointer stays valid for the thread's lifetime, so callers can fetch it once
+ * and sample the counter with a plain load, e.g. before and after handling a
+ * request.
+ */
+uint64_t *allocator_thread_allocatedp(void)
+{
+    return &thread_allocated;
+}
+
+/**
+ * Returns a pointer to the calling thread's running total of usable bytes
+ * freed; see allocator_thread_allocatedp(). Blocks are counted by the thread
+ * that frees them, whichever thread allocated them.
+ */
+uint64_t *allocator_thread_deallocatedp(void)
+{
+    return &thread_deallocated;
+}
+
+/**
+ * Makes 'ctx' the calling thread's allocation context: every block the thread
+ * allocates from now on is charged to it until it is freed, by any thread.
+ * Context 0, the default, has no limits and isn't tracked.
+ *
+ * @return false if 'ctx' is out of range
+ */
+bool alloc_context_set(unsigned int ctx)
+{
+    if (ctx >= ALLOC_MAX_CONTEXTS) {
+        return false;
+    }
+    my_context = ctx;
+    return true;
+}
+
+unsigned int alloc_context_get(void)
+{
+    return my_context;
+}
+
+/**
+ * Sets the limits on a context's live bytes (0 for no limit). Allocations
+ * that would go over the hard limit fail with ENOMEM; going over the soft
+ * limit is counted in soft_breaches and logged. Lowering a limit doesn't
+ * affect blocks that are already allocated.
+ *
+ * @return false if 'ctx' is out of range or the default context
+ */
+bool alloc_context_set_limits(unsigned int ctx, size_t soft_limit,
+        size_t hard_limit)
+{
+    if (ctx == 0 || ctx >= ALLOC_MAX_CONTEXTS) {
+        return false;
+    }
+    contexts[ctx].soft_limit = soft_limit;
+    contexts[ctx].hard_limit = hard_limit;
+    return true;
+}
+
+/**
+ * Fills in the usage and limits of a context.
+ *
+ * @return false if 'ctx' is out of range
+ */
+bool alloc_context_stats(unsigned int ctx, struct alloc_context_stats *stats)
+{
+    if (ctx >= ALLOC_MAX_CONTEXTS) {
+        return false;
+    }
+
+    struct context *context = &contexts[ctx];
+    *stats = (struct alloc_context_stats) {
+        .live_bytes = context->live_bytes,
+        .peak_bytes = context->peak_bytes,
+        .soft_limit = context->soft_limit,
+        .hard_limit = context->hard_limit,
+        .soft_breaches = context->soft_breaches,
+        .hard_denials = context->hard_denials,
+    };
     return true;
 }
 
@@ -8,8 +8,13 @@
 #define ALLOCATOR_H
 
 #include <pthread.h>
+
+#include "lfstack.h"
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+struct arena;
 
 /* -- Helper functions -- */
 // size_t align(size_t orig_size, size_t alignment);
@@ -19,18 +24,24 @@
 // void add_free(struct mem_block *block);
 struct mem_block *split_block(struct mem_block *block, size_t size);
 struct mem_block *merge_block(struct mem_block *block);
-void *reuse(size_t size);
-void *first_fit(size_t size);
-void *worst_fit(size_t size);
-void *best_fit(size_t size);
+void *reuse(struct arena *arena, size_t size);
+void *first_fit(struct arena *arena, size_t size);
+void *worst_fit(struct arena *arena, size_t size);
+void *best_fit(struct arena *arena, size_t size);
 bool leak_check(void);
 void print_memory(void);
+int alloc_size_class(size_t size);
+size_t alloc_size_class_limit(int class);
 
 /* -- C Memory API functions -- */
 void *malloc_impl(size_t size, char *name);
+void *malloc_critical(size_t size, char *name);
+void *malloc_near(void *hint, size_t size, char *name);
 void free_impl(void *ptr);
+size_t free_tagged(const char *tag);
 void *calloc_impl(size_t nmemb, size_t size, char *name);
 void *realloc_impl(void *ptr, size_t size, char *name);
+void *reallocarray_impl(void *ptr, size_t nmemb, size_t size, char *name);
 
 /**
  * Defines metadata structure for memory blocks. This structure is prefixed
@@ -45,7 +56,10 @@ struct mem_block {
 
     /**
      * The name of this memory block. If the user doesn't specify a name for the
-     * block, it should be left empty (a single null byte).
+     * block, it should be left empty (a single null byte); the bytes after it
+     * may then hold the allocation site (see allocator_set_site()). The last
+     * two bytes hold the block's allocation context (see alloc_context_set()),
+     * so names are cut off after ALLOC_NAME_MAX characters.
      */
     char name[32];
 
@@ -57,10 +71,404 @@ struct mem_block {
     struct mem_block *prev_block;
 } __attribute__((packed));
 
+/**
+ * Metadata stored at the start of every mapped region, directly before the
+ * region's first block (so a block's region header is at block->region - 1).
+ */
+struct region {
+    /** Size of the whole mapping, including this header */
+    size_t size;
+
+    /** Page faults taken while mapping and first touching the region */
+    size_t minor_faults;
+    size_t major_faults;
+
+    /** Index of the region's descriptor in its arena's region table */
+    size_t slot;
+
+    /** Arena that owns the region, or NULL while it sits in the region pool */
+    struct arena *arena;
+
+    /** Link in the empty region pool */
+    struct lfstack_node link;
+
+    /**
+     * Filter of the names given to blocks in this region (one bit per name
+     * hash, never cleared while the region is in use) that lets free_tagged()
+     * skip regions holding none of its blocks
+     */
+    uint64_t tags[2];
+} __attribute__((packed));
+
+
 struct free_block {
     struct mem_block block;
     struct free_block *next_free;
     struct free_block *prev_free;
 } __attribute__((packed));
 
+/**
+ * Tunable allocator parameters, adjusted at runtime via allocator_set_param().
+ */
+enum alloc_param {
+    /**
+     * Requests at or above this many bytes get a dedicated mapping that skips
+     * the free list and is unmapped as soon as it is freed.
+     */
+    ALLOC_PARAM_MMAP_THRESHOLD,
+
+    /**
+     * Maximum number of bytes worth of empty regions kept mapped in the shared
+     * region pool, where any arena can reuse them, instead of being unmapped
+     * when their last block is freed.
+     */
+    ALLOC_PARAM_TRIM_THRESHOLD,
+
+    /** Extra bytes added to every new region mapping. */
+    ALLOC_PARAM_TOP_PAD,
+
+    /**
+     * Number of arenas threads are spread across (at most ALLOC_MAX_ARENAS).
+     * Only affects threads that haven't allocated yet.
+     */
+    ALLOC_PARAM_ARENA_MAX,
+
+    /**
+     * Bytes each thread's cache of freed small blocks may grow to, summed over
+     * the tuned capacities of all its size classes. 0 disables thread caches.
+     */
+    ALLOC_PARAM_TCACHE_BUDGET,
+
+    /**
+     * Most threads print_memory(), leak_check() and allocator_stats() spread
+     * a heap walk across. 0 (the default) uses one per CPU; small heaps are
+     * always walked by the calling thread alone.
+     */
+    ALLOC_PARAM_WALK_THREADS,
+
+    /**
+     * Largest region mapped on a free list miss. Regions start at 16 KiB and
+     * double with each miss in the same size class, up to half the arena's
+     * heap or this limit (4 MiB by default). 0 maps only what the request
+     * needs.
+     */
+    ALLOC_PARAM_REGION_MAX,
+
+    /**
+     * Bytes mapped and prefaulted up front as an emergency reserve. When
+     * mmap() fails even after caches are purged, the reserve backs
+     * malloc_critical() requests, and any request once an allocation has
+     * failed. Setting it again maps a fresh reserve after one was used; 0
+     * (the default) releases it.
+     */
+    ALLOC_PARAM_EMERGENCY_RESERVE,
+};
+
+/** Longest block name kept; the rest of mem_block.name holds the context */
+#define ALLOC_NAME_MAX 29
+
+/** Number of allocation contexts; context 0 is the default, unlimited one */
+#define ALLOC_MAX_CONTEXTS 1024
+
+/**
+ * Usage and limits of one allocation context, see alloc_context_stats().
+ */
+struct alloc_context_stats {
+    /** Usable bytes of the blocks allocated in the context still in use */
+    size_t live_bytes;
+    size_t peak_bytes;
+    /** Limits on live_bytes (0 if unlimited) */
+    size_t soft_limit;
+    size_t hard_limit;
+    /** Allocations that took live_bytes over the soft limit */
+    size_t soft_breaches;
+    /** Allocations refused for exceeding the hard limit */
+    size_t hard_denials;
+};
+
+/** Upper bound on the number of arenas */
+#define ALLOC_MAX_ARENAS 64
+/** Upper bound on the number of latency-critical arenas, on top of those */
+#define ALLOC_MAX_CRITICAL_ARENAS 16
+
+/** Number of power-of-two size classes statistics are broken down by */
+#define ALLOC_SIZE_CLASSES 24
+
+/** Upper bound (header + data) of the smallest size class */
+#define ALLOC_MIN_CLASS_SIZE 128
+
+/**
+ * Used blocks in one size class and how much of them is actually resident.
+ */
+struct alloc_class_stats {
+    size_t blocks;
+    size_t bytes;
+    size_t resident_bytes;
+};
+
+/**
+ * Snapshot of the allocator's state, filled in by allocator_stats(). Block
+ * counts and byte totals come from walking the block list; the mapping counters
+ * are maintained as regions are mapped and unmapped.
+ */
+struct alloc_stats {
+    /** Bytes currently mapped from the OS (all regions) */
+    size_t mapped_bytes;
+    /** Number of regions currently mapped */
+    size_t regions;
+
+    /** Bytes in dedicated (mmap threshold) regions */
+    size_t dedicated_bytes;
+    /** Number of dedicated (mmap threshold) regions */
+    size_t dedicated_regions;
+
+    /** Bytes in empty regions kept in the region pool (releasable via trim) */
+    size_t retained_bytes;
+    /** Number of empty regions kept in the region pool */
+    size_t retained_regions;
+    /** Regions arenas took from the pool instead of calling mmap() */
+    size_t region_steals;
+
+    /** Number of arenas threads are spread across */
+    size_t arenas;
+    /** Blocks freed from another arena's thread, handed over without a lock */
+    size_t remote_frees;
+    /** Remote frees still waiting for the owning arena to release them */
+    size_t remote_pending;
+
+    /** Latency-critical arenas, see allocator_set_latency_critical() */
+    size_t critical_arenas;
+    /** Bytes reserved up front for latency-critical arenas, and how many of
+     * them could be locked into memory */
+    size_t critical_reserved_bytes;
+    size_t critical_locked_bytes;
+    /** Allocations a critical arena's reserve couldn't satisfy */
+    size_t critical_fallbacks;
+
+    /** Bytes held in the emergency reserve, how many times the reserve was
+     * handed out, and allocations that failed even after purging caches */
+    size_t emergency_reserved_bytes;
+    size_t emergency_releases;
+    size_t alloc_failures;
+
+    /** Arena lock acquisitions that found the lock held, and the total time
+     * they spent waiting for it */
+    size_t lock_contentions;
+    size_t lock_wait_ns;
+
+    /** Freed blocks held in thread caches or remote free stacks */
+    size_t parked_blocks;
+    size_t parked_bytes;
+
+    /**
+     * Thread cache activity, published by each thread at its tuning passes:
+     * mallocs served from the cache, mallocs that fell through to the arena,
+     * and frees that found their cache bin full.
+     */
+    size_t tcache_hits;
+    size_t tcache_misses;
+    size_t tcache_overflows;
+    /** Tuner decisions: bin capacities grown, shrunk, or kept by the budget */
+    size_t tcache_grows;
+    size_t tcache_shrinks;
+    size_t tcache_budget_denials;
+    /** Bytes all thread caches may currently hold (sum of tuned capacities) */
+    size_t tcache_capacity_bytes;
+
+    /** Blocks in use and their total size (header + data) */
+    size_t used_blocks;
+    size_t used_bytes;
+
+    /** Blocks on the free list and their total size (header + data) */
+    size_t free_blocks;
+    size_t free_bytes;
+
+    /** Lifetime number of mmap() and munmap() calls */
+    size_t mmap_count;
+    size_t munmap_count;
+
+    /** High-water marks of dedicated regions and their bytes */
+    size_t max_dedicated_regions;
+    size_t max_dedicated_bytes;
+
+    /** Page faults taken while mapping and first touching regions */
+    size_t minor_faults;
+    size_t major_faults;
+
+    /** Reallocs that had to move a block, and the bytes they copied */
+    size_t realloc_copies;
+    size_t realloc_copied_bytes;
+    /** Reallocs that grew by absorbing the following free block */
+    size_t realloc_in_place;
+    /** Reallocs that grew into slack reserved by an earlier realloc */
+    size_t realloc_slack_hits;
+    /** Bytes that in-place and slack growth would otherwise have copied */
+    size_t realloc_avoided_bytes;
+
+    /** malloc_near() calls placed next to their hint, and those that weren't */
+    size_t near_hits;
+    size_t near_misses;
+
+    /** Bytes of mapped regions resident in memory (sampled with mincore) */
+    size_t resident_bytes;
+    /** Resident bytes that belong to free blocks */
+    size_t free_resident_bytes;
+
+    /** Used blocks broken down by size class, see alloc_size_class() */
+    struct alloc_class_stats classes[ALLOC_SIZE_CLASSES];
+};
+
+/**
+ * Summary of one region, kept in a dense per-arena table so region-level work
+ * (stats, walks, finding empty regions) doesn't chase block pointers across
+ * mappings. Occupancy is updated as blocks change hands.
+ */
+struct region_desc {
+    struct region *base;
+    /** Size of the whole mapping, including the region header */
+    size_t size;
+    /** Bytes in used (or parked) blocks and in free blocks, headers included */
+    size_t used_bytes;
+    size_t free_bytes;
+    /** Number of blocks the region is split into */
+    size_t blocks;
+    /** Bumped whenever blocks are split or merged (see allocator_iterate()) */
+    size_t version;
+    /** Resident bytes as of the last mincore() sample (stats/print_memory) */
+    size_t resident;
+    struct arena *arena;
+};
+
+/**
+ * An independent heap with its own lock, block list, and free list. Threads are
+ * spread across arenas so they don't all contend on one lock; a block is always
+ * returned to the arena that owns its region.
+ */
+struct arena {
+    pthread_mutex_t lock;
+
+    /**
+     * Descriptors of the arena's regions, in no particular order. While a
+     * heap iteration is in progress, unmapped regions leave a hole (a NULL
+     * base) instead of being swapped out, so paused cursors stay valid.
+     */
+    struct region_desc *regions;
+    size_t region_count;
+    size_t region_capacity;
+    size_t region_holes;
+
+    struct free_block *free_head;
+    struct free_block *free_tail;
+
+    /** Regions mapped on free list misses per size class (region_target()) */
+    unsigned int class_regions[ALLOC_SIZE_CLASSES];
+
+    /**
+     * Set for a latency-critical thread's own arena: its regions are reserved
+     * up front, and frees never merge blocks or unmap regions. Merging is
+     * left to a malloc that finds no fit, or to allocator_trim().
+     */
+    bool critical;
+
+    /**
+     * Blocks freed by threads that don't own this arena. They are pushed
+     * without taking the lock and released in a batch by the next thread that
+     * does hold it.
+     */
+    struct lfstack remote_frees;
+
+    /** Counters that can't be recovered by walking the block list */
+    struct alloc_stats totals;
+};
+
+/** State of a block as reported by allocator_walk() and allocator_iterate() */
+enum alloc_block_state {
+    ALLOC_BLOCK_USED,
+    ALLOC_BLOCK_FREE,
+    /** Freed, but still held by a thread cache or remote free stack */
+    ALLOC_BLOCK_PARKED,
+};
+
+struct alloc_block_info {
+    /** Start of the block's data */
+    void *ptr;
+    /** Size of the block (header + data) */
+    size_t size;
+    enum alloc_block_state state;
+    const char *name;
+    /** Code that allocated an unnamed block, if it was recorded */
+    void *site;
+    /** Index of the arena that owns the block */
+    size_t arena;
+    /** Allocation context the block is charged to */
+    unsigned int context;
+    /** Mapping the block lives in (starting with its region header) */
+    void *region;
+    size_t region_size;
+};
+
+/**
+ * One region as reported by allocator_walk_regions(). Residency is sampled
+ * with mincore() during the walk; fault counts are those taken while mapping
+ * and first touching the region.
+ */
+struct alloc_region_info {
+    /** Start of the mapping (the region header) */
+    void *region;
+    /** Index of the arena that owns the region */
+    size_t arena;
+    size_t mapped_bytes;
+    size_t resident_bytes;
+    /** Bytes in used (or parked) blocks and in free blocks, headers included */
+    size_t used_bytes;
+    size_t free_bytes;
+    size_t blocks;
+    size_t minor_faults;
+    size_t major_faults;
+    /** Mapped for a single allocation at or above ALLOC_PARAM_MMAP_THRESHOLD */
+    bool dedicated;
+};
+
+/**
+ * Position of an incremental heap iteration; see allocator_iterate().
+ */
+struct alloc_cursor {
+    size_t arena;
+    /** Slot of the current region in the arena's region table */
+    size_t slot;
+    /** Address of the next block to report in that region (0 for its first) */
+    uintptr_t next;
+    /** Region's version when the cursor stopped, while 'next' is known valid */
+    size_t version;
+    bool done;
+};
+
+/* -- Introspection and tuning -- */
+void allocator_stats(struct alloc_stats *stats);
+void allocator_stats_local(struct alloc_stats *stats);
+size_t allocator_trim(size_t pad);
+bool allocator_set_param(enum alloc_param param, size_t value);
+bool allocator_set_latency_critical(size_t reserve_bytes);
+uint64_t *allocator_thread_allocatedp(void);
+uint64_t *allocator_thread_deallocatedp(void);
+
+/* -- Allocation contexts -- */
+bool alloc_context_set(unsigned int ctx);
+unsigned int alloc_context_get(void);
+bool alloc_context_set_limits(unsigned int ctx, size_t soft_limit,
+        size_t hard_limit);
+bool alloc_context_stats(unsigned int ctx, struct alloc_context_stats *stats);
+void allocator_walk(
+        void (*visit)(const struct alloc_block_info *info, void *arg),
+        void *arg);
+void allocator_walk_regions(
+        void (*visit)(const struct alloc_region_info *info, void *arg),
+        void *arg);
+void allocator_set_site(void *ptr, void *site);
+void allocator_iterate_begin(struct alloc_cursor *cursor);
+size_t allocator_iterate(struct alloc_cursor *cursor, size_t max_blocks,
+        void (*visit)(const struct alloc_block_info *info, void *arg),
+        void *arg);
+void allocator_iterate_end(struct alloc_cursor *cursor);
+
 #endif
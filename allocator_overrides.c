@@ -16,11 +16,21 @@
  * (Everything after this point will use your custom allocator -- be careful!)
  */
 
+#include <malloc.h>
+#include <stdio.h>
+
 #include "allocator.h"
 
+/*
+ * Blocks allocated through the standard API have no name, so record the
+ * caller as the allocation site for heap snapshots (see snapshot.h).
+ */
+
 void *malloc(size_t size)
 {
-    return malloc_impl(size, "");
+    void *ptr = malloc_impl(size, "");
+    allocator_set_site(ptr, __builtin_return_address(0));
+    return ptr;
 }
 
 void free(void *ptr)
@@ -30,10 +40,112 @@ void free(void *ptr)
 
 void *calloc(size_t nmemb, size_t size)
 {
-    return calloc_impl(nmemb, size, "");
+    void *ptr = calloc_impl(nmemb, size, "");
+    allocator_set_site(ptr, __builtin_return_address(0));
+    return ptr;
 }
 
 void *realloc(void *ptr, size_t size)
 {
-    return realloc_impl(ptr, size, "");
+    void *new_ptr = realloc_impl(ptr, size, "");
+    allocator_set_site(new_ptr, __builtin_return_address(0));
+    return new_ptr;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    void *new_ptr = reallocarray_impl(ptr, nmemb, size, "");
+    allocator_set_site(new_ptr, __builtin_return_address(0));
+    return new_ptr;
+}
+
+/*
+ * glibc malloc compatibility: operational tooling calls these to inspect and
+ * tune the heap, so map them onto our own introspection/tuning functions.
+ */
+
+int malloc_trim(size_t pad)
+{
+    return allocator_trim(pad) > 0;
+}
+
+/**
+ * Bytes of used blocks inside arena regions. Dedicated mappings hold a single
+ * block spanning all but the region header; they're reported separately.
+ */
+static size_t arena_used_bytes(const struct alloc_stats *stats)
+{
+    size_t dedicated_used = stats->dedicated_bytes
+        - stats->dedicated_regions * sizeof(struct region);
+    /* Counters are gathered arena by arena and may be slightly out of step */
+    return stats->used_bytes > dedicated_used
+        ? stats->used_bytes - dedicated_used : 0;
+}
+
+struct mallinfo2 mallinfo2(void)
+{
+    struct alloc_stats stats;
+    allocator_stats(&stats);
+
+    struct mallinfo2 info = { 0 };
+    info.arena = stats.mapped_bytes - stats.dedicated_bytes;
+    info.ordblks = stats.free_blocks;
+    info.hblks = stats.dedicated_regions;
+    info.hblkhd = stats.dedicated_bytes;
+    info.uordblks = arena_used_bytes(&stats);
+    info.fordblks = stats.free_bytes;
+    info.keepcost = stats.retained_bytes;
+    return info;
+}
+
+struct mallinfo mallinfo(void)
+{
+    struct mallinfo2 info2 = mallinfo2();
+
+    struct mallinfo info = { 0 };
+    info.arena = (int) info2.arena;
+    info.ordblks = (int) info2.ordblks;
+    info.hblks = (int) info2.hblks;
+    info.hblkhd = (int) info2.hblkhd;
+    info.uordblks = (int) info2.uordblks;
+    info.fordblks = (int) info2.fordblks;
+    info.keepcost = (int) info2.keepcost;
+    return info;
+}
+
+void malloc_stats(void)
+{
+    struct alloc_stats stats;
+    allocator_stats(&stats);
+
+    fprintf(stderr, "Arena 0:\n");
+    fprintf(stderr, "system bytes     = %10zu\n",
+            stats.mapped_bytes - stats.dedicated_bytes);
+    fprintf(stderr, "in use bytes     = %10zu\n",
+            arena_used_bytes(&stats));
+    fprintf(stderr, "Total (incl. mmap):\n");
+    fprintf(stderr, "system bytes     = %10zu\n", stats.mapped_bytes);
+    fprintf(stderr, "in use bytes     = %10zu\n", stats.used_bytes);
+    fprintf(stderr, "max mmap regions = %10zu\n", stats.max_dedicated_regions);
+    fprintf(stderr, "max mmap bytes   = %10zu\n", stats.max_dedicated_bytes);
+}
+
+int mallopt(int param, int value)
+{
+    if (value < 0) {
+        return 0;
+    }
+
+    switch (param) {
+        case M_MMAP_THRESHOLD:
+            return allocator_set_param(ALLOC_PARAM_MMAP_THRESHOLD, value);
+        case M_TRIM_THRESHOLD:
+            return allocator_set_param(ALLOC_PARAM_TRIM_THRESHOLD, value);
+        case M_TOP_PAD:
+            return allocator_set_param(ALLOC_PARAM_TOP_PAD, value);
+        case M_ARENA_MAX:
+            return allocator_set_param(ALLOC_PARAM_ARENA_MAX, value);
+        default:
+            return 0;
+    }
 }
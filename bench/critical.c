@@ -0,0 +1,150 @@
+/**
+ * @file
+ *
+ * Check for latency-critical arenas (allocator_set_latency_critical()) whose
+ * reserve runs out. The thread claims a small reserve, then allocates far more
+ * than it holds in each round and frees it all again; each round is timed and
+ * checked:
+ *
+ *  - the allocations past the reserve must be counted as fallbacks, and
+ *  - fallbacks must reuse the free space of the regular arena they land in,
+ *    so the bytes mapped outside the reserve stay bounded instead of growing
+ *    with every fallback.
+ *
+ * Usage:
+ *   ./bench/critical [-n allocations] [-s size] [-k reserve_kb] [-r rounds]
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "allocator.h"
+
+struct critical_config {
+    size_t allocations;
+    size_t size;
+    size_t reserve_kb;
+    int rounds;
+};
+
+static struct critical_config config = {
+    .allocations = 5000,
+    .size = 100,
+    .reserve_kb = 64,
+    .rounds = 5,
+};
+
+/*
+ * What the regular arena may map beyond the live bytes of one round: regions
+ * grow geometrically up to ALLOC_PARAM_REGION_MAX (4 MiB by default), so the
+ * last region mapped can be about that large and mostly unused.
+ */
+#define FALLBACK_SLACK (8 * 1024 * 1024)
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+        + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static bool run_round(int round, void **ptrs)
+{
+    struct alloc_stats before, peak;
+    allocator_stats(&before);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < config.allocations; ++i) {
+        ptrs[i] = malloc_impl(config.size, "critical");
+        if (ptrs[i] == NULL) {
+            fprintf(stderr, "critical: malloc failed\n");
+            return false;
+        }
+    }
+    double seconds = elapsed(&start);
+    allocator_stats(&peak);
+    for (size_t i = 0; i < config.allocations; ++i) {
+        free_impl(ptrs[i]);
+    }
+
+    bool ok = true;
+    size_t fallbacks = peak.critical_fallbacks - before.critical_fallbacks;
+    size_t mmaps = peak.mmap_count - before.mmap_count;
+    size_t outside = peak.mapped_bytes - peak.critical_reserved_bytes;
+    size_t live = config.allocations * (config.size + sizeof(struct mem_block));
+    if (fallbacks == 0) {
+        fprintf(stderr, "critical: the reserve never ran out\n");
+        ok = false;
+    }
+    if (outside > live + FALLBACK_SLACK) {
+        fprintf(stderr, "critical: %zu bytes mapped outside the reserve for "
+                "%zu live bytes\n", outside, live);
+        ok = false;
+    }
+
+    printf("round %d  %10.0f mallocs/s  %5zu fallbacks  %4zu mmaps  "
+            "%9zu bytes mapped outside the reserve  %s\n", round,
+            config.allocations / seconds, fallbacks, mmaps, outside,
+            ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n allocations] [-s size] [-k reserve_kb] "
+            "[-r rounds]\n"
+            "  -n  allocations per round (default %zu)\n"
+            "  -s  bytes per allocation (default %zu)\n"
+            "  -k  critical reserve in KiB (default %zu)\n"
+            "  -r  rounds (default %d)\n",
+            prog, config.allocations, config.size, config.reserve_kb,
+            config.rounds);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:s:k:r:h")) != -1) {
+        switch (c) {
+            case 'n':
+                config.allocations = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                config.size = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                config.reserve_kb = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                config.rounds = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (config.allocations < 1 || config.size < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Allocated before the thread turns critical, so it stays put */
+    void **ptrs = malloc_impl(config.allocations * sizeof(void *), "ptrs");
+    if (ptrs == NULL
+            || !allocator_set_latency_critical(config.reserve_kb * 1024)) {
+        perror("critical");
+        return 1;
+    }
+
+    bool ok = true;
+    for (int round = 1; round <= config.rounds; ++round) {
+        ok &= run_round(round, ptrs);
+    }
+    return ok ? 0 : 1;
+}
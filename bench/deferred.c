@@ -0,0 +1,222 @@
+/**
+ * @file
+ *
+ * Stress test for epoch-based reclamation (epoch.h). Writer threads keep
+ * replacing nodes in a table of shared slots and retire the old ones with
+ * free_deferred(), while reader threads look nodes up inside
+ * epoch_enter()/epoch_exit() and check every word of them. Each node is filled
+ * with a pattern derived from its sequence number, so a reader that sees a
+ * node change under it caught a block being reused, or written to by the
+ * reclaimer, before its grace period ended, and the run fails.
+ *
+ * Writers exit and are replaced every few thousand retirements, leaving their
+ * limbo lists behind. Afterward every retired block must have been freed.
+ *
+ * Usage:
+ *   ./bench/deferred [-n retires] [-w writers] [-r readers] [-s slots]
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "allocator.h"
+#include "epoch.h"
+
+#define NODE_WORDS 8
+#define NODE_MAGIC UINT64_C(0x9e3779b97f4a7c15)
+/* Retirements before a writer thread exits and a new one takes over */
+#define WRITER_LIFETIME 4096
+
+struct node {
+    uint64_t words[NODE_WORDS];
+};
+
+struct epoch_config {
+    size_t retires;
+    int writers;
+    int readers;
+    size_t slots;
+};
+
+static struct epoch_config config = {
+    .retires = 1000 * 1000,
+    .writers = 2,
+    .readers = 4,
+    .slots = 64,
+};
+
+static struct node *_Atomic *slots;
+static atomic_size_t next_seq;
+static atomic_size_t reads;
+static atomic_size_t violations;
+static atomic_bool stop;
+
+static struct node *node_new(void)
+{
+    struct node *node = malloc_impl(sizeof(*node), "epoch node");
+    if (node == NULL) {
+        return NULL;
+    }
+    uint64_t seq = atomic_fetch_add(&next_seq, 1);
+    for (int i = 0; i < NODE_WORDS; ++i) {
+        node->words[i] = (seq + i) ^ NODE_MAGIC;
+    }
+    return node;
+}
+
+static bool node_intact(struct node *node)
+{
+    uint64_t seq = node->words[0] ^ NODE_MAGIC;
+    for (int i = 1; i < NODE_WORDS; ++i) {
+        if (node->words[i] != ((seq + i) ^ NODE_MAGIC)) {
+            return false;
+        }
+    }
+    /* Read it all again: the node must not change while we hold it */
+    for (int i = 0; i < NODE_WORDS; ++i) {
+        if (node->words[i] != ((seq + i) ^ NODE_MAGIC)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *reader_thread(void *arg)
+{
+    unsigned int seed = (unsigned int) (uintptr_t) arg;
+    size_t count = 0;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        epoch_enter();
+        struct node *node = atomic_load(&slots[rand_r(&seed) % config.slots]);
+        if (node != NULL && !node_intact(node)) {
+            atomic_fetch_add(&violations, 1);
+        }
+        epoch_exit();
+        count++;
+    }
+    atomic_fetch_add(&reads, count);
+    return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+    unsigned int seed = (unsigned int) (uintptr_t) arg;
+    for (size_t i = 0; i < WRITER_LIFETIME; ++i) {
+        struct node *node = node_new();
+        if (node == NULL) {
+            fprintf(stderr, "epoch: malloc failed\n");
+            break;
+        }
+        free_deferred(atomic_exchange(&slots[rand_r(&seed) % config.slots],
+                    node));
+    }
+    /* Exit without flushing: the limbo lists are left to other threads */
+    return NULL;
+}
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+        + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n retires] [-w writers] [-r readers] [-s slots]\n"
+            "  -n  blocks to retire in total (default %zu)\n"
+            "  -w  concurrent writer threads (default %d)\n"
+            "  -r  reader threads (default %d)\n"
+            "  -s  shared slots (default %zu)\n",
+            prog, config.retires, config.writers, config.readers,
+            config.slots);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:w:r:s:h")) != -1) {
+        switch (c) {
+            case 'n':
+                config.retires = strtoull(optarg, NULL, 10);
+                break;
+            case 'w':
+                config.writers = atoi(optarg);
+                break;
+            case 'r':
+                config.readers = atoi(optarg);
+                break;
+            case 's':
+                config.slots = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (config.writers < 1 || config.readers < 0 || config.slots < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    slots = calloc_impl(config.slots, sizeof(*slots), "slots");
+    pthread_t *readers = calloc_impl(config.readers + 1, sizeof(pthread_t),
+            "readers");
+    pthread_t *writers = malloc_impl(
+            config.writers * sizeof(pthread_t), "writers");
+    if (slots == NULL || readers == NULL || writers == NULL) {
+        perror("epoch");
+        return 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < config.readers; ++i) {
+        pthread_create(&readers[i], NULL, reader_thread,
+                (void *) (uintptr_t) (i + 1));
+    }
+
+    /* Each generation of writers retires WRITER_LIFETIME blocks apiece */
+    size_t generations = config.retires
+        / ((size_t) config.writers * WRITER_LIFETIME) + 1;
+    for (size_t g = 0; g < generations; ++g) {
+        for (int i = 0; i < config.writers; ++i) {
+            pthread_create(&writers[i], NULL, writer_thread,
+                    (void *) (uintptr_t) (g * config.writers + i + 1000));
+        }
+        for (int i = 0; i < config.writers; ++i) {
+            pthread_join(writers[i], NULL);
+        }
+    }
+
+    atomic_store(&stop, true);
+    for (int i = 0; i < config.readers; ++i) {
+        pthread_join(readers[i], NULL);
+    }
+    double seconds = elapsed(&start);
+
+    for (size_t i = 0; i < config.slots; ++i) {
+        free_deferred(atomic_exchange(&slots[i], NULL));
+    }
+    free_deferred_flush();
+
+    struct epoch_stats stats;
+    allocator_epoch_stats(&stats);
+    size_t retired = generations * config.writers * WRITER_LIFETIME;
+    bool ok = atomic_load(&violations) == 0 && stats.pending_blocks == 0;
+    printf("%zu x %d writers, %d readers  %10.0f retires/s  %10.0f reads/s  "
+            "%zu advances  %zu pending  %zu violations  %s\n",
+            generations, config.writers, config.readers, retired / seconds,
+            atomic_load(&reads) / seconds, stats.advances,
+            stats.pending_blocks, atomic_load(&violations),
+            ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
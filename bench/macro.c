@@ -0,0 +1,336 @@
+/**
+ * @file
+ *
+ * Real-application macro-benchmark driver. Runs a set of allocation-heavy
+ * programs that are available on this machine, once with the system allocator
+ * and once with LD_PRELOAD=allocator.so, and reports wall time, max RSS, and
+ * page faults for each so we can judge whole-program impact.
+ *
+ * Workloads whose programs can't be found in PATH are skipped. Inputs are
+ * generated into a temporary directory that is removed afterward.
+ *
+ * Usage:
+ *   ./bench/macro [-l allocator.so] [-r repetitions] [-s scale] [workload...]
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct workload {
+    /** Name used on the command line and in the report */
+    const char *name;
+    /** Program that must be in PATH for the workload to run */
+    const char *program;
+    /** Writes the workload's input files into 'dir' (may be NULL) */
+    bool (*setup)(const char *dir, int scale);
+    /**
+     * Shell command; %1$s is the temp directory, %2$d the scale factor. A
+     * command that uses %2$d must also use %1$s: positional conversions may
+     * not skip an argument.
+     */
+    const char *command;
+};
+
+struct measurement {
+    double wall;
+    long max_rss_kb;
+    long minor_faults;
+    long major_faults;
+    int status;
+};
+
+static bool setup_sort(const char *dir, int scale)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/sort.txt", dir);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("fopen");
+        return false;
+    }
+
+    uint64_t state = 88172645463325252ULL;
+    for (long i = 0; i < 500000L * scale; ++i) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        fprintf(file, "%016llx line %ld\n", (unsigned long long) state, i);
+    }
+    fclose(file);
+    return true;
+}
+
+static bool setup_gcc(const char *dir, int scale)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/generated.c", dir);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("fopen");
+        return false;
+    }
+
+    for (int i = 0; i < 400 * scale; ++i) {
+        fprintf(file,
+                "struct s%d { int a[%d]; double b; struct s%d *next; };\n"
+                "int f%d(struct s%d *p, int n) {\n"
+                "    int sum = 0;\n"
+                "    for (int i = 0; i < n && p; ++i, p = p->next) {\n"
+                "        sum += p->a[i %% %d] * %d + (int) p->b;\n"
+                "        if (sum > %d) sum ^= i << 3; else sum -= i;\n"
+                "    }\n"
+                "    return sum;\n"
+                "}\n",
+                i, i % 16 + 1, i, i, i, i % 16 + 1, i, i * 31);
+    }
+    fclose(file);
+    return true;
+}
+
+static struct workload workloads[] = {
+    {
+        "sort", "sort", setup_sort,
+        "LC_ALL=C exec sort -o /dev/null %1$s/sort.txt",
+    },
+    {
+        "gcc", "gcc", setup_gcc,
+        "exec gcc -O2 -c %1$s/generated.c -o %1$s/generated.o",
+    },
+    {
+        "python3", "python3", NULL,
+        "cd %1$s && exec python3 -c '"
+        "d = {}\n"
+        "for r in range(%2$d * 10):\n"
+        "    objs = [{\"k\": str(i), \"v\": [i] * (i %% 7)}\n"
+        "            for i in range(100000)]\n"
+        "    for o in objs[::3]: d[o[\"k\"]] = o\n"
+        "    del objs\n"
+        "'",
+    },
+    {
+        "sqlite3", "sqlite3", NULL,
+        "cd %1$s && exec sqlite3 :memory: '"
+        "CREATE TABLE t(a INTEGER, b TEXT);"
+        "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c "
+        "WHERE x < %2$d * 200000) "
+        "INSERT INTO t SELECT x, hex(randomblob(32)) FROM c;"
+        "CREATE INDEX tb ON t(b);"
+        "SELECT count(*) FROM t WHERE b LIKE \"A%%\";' > /dev/null",
+    },
+};
+
+static bool in_path(const char *program)
+{
+    char *path = getenv("PATH");
+    if (path == NULL) {
+        return false;
+    }
+
+    char *paths = strdup(path);
+    char *save = NULL;
+    bool found = false;
+    for (char *dir = strtok_r(paths, ":", &save); dir != NULL;
+            dir = strtok_r(NULL, ":", &save)) {
+        char candidate[PATH_MAX];
+        snprintf(candidate, sizeof(candidate), "%s/%s", dir, program);
+        if (access(candidate, X_OK) == 0) {
+            found = true;
+            break;
+        }
+    }
+    free(paths);
+    return found;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Runs a shell command and collects its resource usage. The rusage returned by
+ * wait4() covers the child along with any descendants it waited for.
+ */
+static bool run(const char *command, const char *preload,
+        struct measurement *result)
+{
+    double start = now();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return false;
+    } else if (pid == 0) {
+        if (preload != NULL) {
+            setenv("LD_PRELOAD", preload, 1);
+        } else {
+            unsetenv("LD_PRELOAD");
+        }
+        execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+        perror("execl");
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) == -1) {
+        if (errno != EINTR) {
+            perror("wait4");
+            return false;
+        }
+    }
+
+    result->wall = now() - start;
+    result->max_rss_kb = usage.ru_maxrss;
+    result->minor_faults = usage.ru_minflt;
+    result->major_faults = usage.ru_majflt;
+    result->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return true;
+}
+
+static int compare_wall(const void *a, const void *b)
+{
+    const struct measurement *ma = a, *mb = b;
+    return (ma->wall > mb->wall) - (ma->wall < mb->wall);
+}
+
+static void report(const char *name, const char *allocator,
+        struct measurement *runs, int reps)
+{
+    /* Report the median run by wall time */
+    qsort(runs, reps, sizeof(*runs), compare_wall);
+    struct measurement *median = &runs[reps / 2];
+    printf("%-10s %-14s %10.3f %12ld %12ld %8ld %6d\n",
+            name, allocator, median->wall, median->max_rss_kb,
+            median->minor_faults, median->major_faults, median->status);
+    fflush(stdout);
+}
+
+static bool selected(const char *name, int argc, char *argv[])
+{
+    if (optind >= argc) {
+        return true;
+    }
+    for (int i = optind; i < argc; ++i) {
+        if (strcmp(argv[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-l allocator.so] [-r repetitions] [-s scale] "
+            "[workload...]\n"
+            "  -l  allocator to preload (default ./allocator.so)\n"
+            "  -r  runs per configuration; the median is reported "
+            "(default 3)\n"
+            "  -s  input size multiplier (default 1)\n"
+            "Workloads:",
+            prog);
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i) {
+        fprintf(stderr, " %s", workloads[i].name);
+    }
+    fputc('\n', stderr);
+}
+
+int main(int argc, char *argv[])
+{
+    char *allocator = "./allocator.so";
+    int reps = 3;
+    int scale = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "l:r:s:h")) != -1) {
+        switch (c) {
+            case 'l':
+                allocator = optarg;
+                break;
+            case 'r':
+                reps = atoi(optarg);
+                break;
+            case 's':
+                scale = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    char preload[PATH_MAX];
+    if (reps < 1 || scale < 1 || realpath(allocator, preload) == NULL) {
+        if (reps >= 1 && scale >= 1) {
+            perror(allocator);
+        }
+        usage(argv[0]);
+        return 1;
+    }
+
+    char dir[] = "/tmp/allocator-macro-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    struct measurement *runs = calloc(reps, sizeof(*runs));
+
+    printf("%-10s %-14s %10s %12s %12s %8s %6s\n",
+            "workload", "allocator", "wall_s", "max_rss_kb",
+            "minor_flt", "major_flt", "exit");
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i) {
+        struct workload *w = &workloads[i];
+        if (!selected(w->name, argc, argv)) {
+            continue;
+        }
+        if (!in_path(w->program)) {
+            printf("%-10s (skipped: %s not found)\n", w->name, w->program);
+            continue;
+        }
+        if (w->setup != NULL && !w->setup(dir, scale)) {
+            printf("%-10s (skipped: setup failed)\n", w->name);
+            continue;
+        }
+
+        char command[4096];
+        snprintf(command, sizeof(command), w->command, dir, scale);
+
+        const char *configs[] = { NULL, preload };
+        const char *labels[] = { "system", "allocator.so" };
+        for (int conf = 0; conf < 2; ++conf) {
+            int completed = 0;
+            for (int r = 0; r < reps; ++r) {
+                if (run(command, configs[conf], &runs[completed])) {
+                    completed++;
+                }
+            }
+            if (completed > 0) {
+                report(w->name, labels[conf], runs, completed);
+            }
+        }
+    }
+
+    free(runs);
+
+    char cleanup[PATH_MAX + 16];
+    snprintf(cleanup, sizeof(cleanup), "rm -rf '%s'", dir);
+    if (system(cleanup) != 0) {
+        fprintf(stderr, "failed to remove %s\n", dir);
+    }
+    return 0;
+}
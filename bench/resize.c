@@ -0,0 +1,143 @@
+/**
+ * @file
+ *
+ * Throughput and correctness check for realloc_impl(). A buffer is grown by
+ * small appends, the way string builders and vectors grow, then shrunk back to
+ * a few bytes; each round is timed and checked:
+ *
+ *  - every byte written before a realloc must survive it,
+ *  - geometric slack must keep the number of copies logarithmic, and
+ *  - shrinking a block that grew must give its slack back, so the heap's used
+ *    bytes return to where they started instead of staying at the peak.
+ *
+ * Usage:
+ *   ./bench/resize [-n appends] [-a append_size] [-r rounds]
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "allocator.h"
+
+struct resize_config {
+    size_t appends;
+    size_t append_size;
+    int rounds;
+};
+
+static struct resize_config config = {
+    .appends = 100000,
+    .append_size = 7,
+    .rounds = 5,
+};
+
+/* What a shrunk block may still hold beyond its requested size */
+#define SHRINK_SIZE 64
+#define SHRINK_SLACK 4096
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+        + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static bool run_round(int round)
+{
+    struct alloc_stats before, grown, shrunk;
+    allocator_stats(&before);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned char *buf = NULL;
+    size_t len = 0;
+    for (size_t i = 0; i < config.appends; ++i) {
+        buf = realloc_impl(buf, len + config.append_size, "resize");
+        if (buf == NULL) {
+            fprintf(stderr, "resize: realloc failed\n");
+            return false;
+        }
+        for (size_t k = 0; k < config.append_size; ++k, ++len) {
+            buf[len] = (unsigned char) len;
+        }
+    }
+    double seconds = elapsed(&start);
+
+    bool ok = true;
+    for (size_t i = 0; i < len; ++i) {
+        if (buf[i] != (unsigned char) i) {
+            fprintf(stderr, "resize: byte %zu lost while growing\n", i);
+            ok = false;
+            break;
+        }
+    }
+    allocator_stats(&grown);
+
+    buf = realloc_impl(buf, SHRINK_SIZE, "resize");
+    for (size_t i = 0; i < SHRINK_SIZE; ++i) {
+        if (buf[i] != (unsigned char) i) {
+            fprintf(stderr, "resize: byte %zu lost while shrinking\n", i);
+            ok = false;
+            break;
+        }
+    }
+    allocator_stats(&shrunk);
+    size_t kept = shrunk.used_bytes - before.used_bytes;
+    if (kept > SHRINK_SIZE + SHRINK_SLACK) {
+        fprintf(stderr, "resize: shrunk block still holds %zu bytes\n", kept);
+        ok = false;
+    }
+    free_impl(buf);
+
+    size_t copies = grown.realloc_copies - before.realloc_copies;
+    printf("round %d  %10.0f reallocs/s  %6zu copies  peak %9zu -> %5zu bytes"
+            "  %s\n", round, config.appends / seconds, copies,
+            grown.used_bytes - before.used_bytes, kept, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n appends] [-a append_size] [-r rounds]\n"
+            "  -n  appends per round (default %zu)\n"
+            "  -a  bytes per append (default %zu)\n"
+            "  -r  rounds (default %d)\n",
+            prog, config.appends, config.append_size, config.rounds);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:a:r:h")) != -1) {
+        switch (c) {
+            case 'n':
+                config.appends = strtoull(optarg, NULL, 10);
+                break;
+            case 'a':
+                config.append_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                config.rounds = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (config.append_size < 1 || config.appends * config.append_size
+            < SHRINK_SIZE) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    bool ok = true;
+    for (int round = 1; round <= config.rounds; ++round) {
+        ok &= run_round(round);
+    }
+    return ok ? 0 : 1;
+}
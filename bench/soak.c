@@ -0,0 +1,344 @@
+/**
+ * @file
+ *
+ * Long-running fragmentation soak benchmark. Runs a mixed allocation workload
+ * against liballocator.so for many millions of operations and periodically
+ * samples RSS, mapped bytes, live bytes, and region count as CSV so slow
+ * fragmentation creep shows up before a release does.
+ *
+ * Each thread keeps its live blocks in a timing wheel: every operation frees
+ * the blocks whose lifetime expired this tick and allocates a new one with a
+ * size and lifetime drawn from the configured distributions. The wheel links
+ * are stored inside the blocks themselves, so the benchmark never allocates
+ * from any other heap while it runs.
+ *
+ * When liballocator.so is built with PERF=1, the hardware counter deltas per
+ * allocator code path are printed to stderr at the end of the run.
+ *
+ * Usage:
+ *   ./bench/soak [-n ops] [-t threads] [-s min:max] [-l short:long:pct]
+ *                [-i interval_ms] [-o out.csv]
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "perf.h"
+
+/** Longest lifetime (in operations) a block can have */
+#define WHEEL_SLOTS 65536
+
+struct soak_config {
+    size_t ops;
+    int threads;
+    size_t min_size;
+    size_t max_size;
+    size_t short_life;
+    size_t long_life;
+    int long_pct;
+    int interval_ms;
+};
+
+/** Header stored at the start of every live block to chain it into the wheel */
+struct live_block {
+    struct live_block *next;
+    size_t size;
+};
+
+static struct soak_config config = {
+    .ops = 50 * 1000 * 1000,
+    .threads = 4,
+    .min_size = 16,
+    .max_size = 16 * 1024,
+    .short_life = 64,
+    .long_life = 32768,
+    .long_pct = 5,
+    .interval_ms = 1000,
+};
+
+static atomic_size_t total_ops;
+static atomic_size_t live_bytes;
+static atomic_bool done;
+
+/* xorshift64*: cheap and good enough for workload generation */
+static uint64_t next_rand(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double rand_unit(uint64_t *state)
+{
+    return (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Block sizes are log-uniform between min_size and max_size, which keeps small
+ * sizes common while still exercising the large end of the range.
+ */
+static size_t sample_size(uint64_t *state)
+{
+    double lo = log((double) config.min_size);
+    double hi = log((double) config.max_size);
+    return (size_t) exp(lo + (hi - lo) * rand_unit(state));
+}
+
+/**
+ * Lifetimes are exponentially distributed around either the short or long
+ * mean, with long_pct percent of blocks being long-lived.
+ */
+static size_t sample_life(uint64_t *state)
+{
+    bool is_long = (int) (next_rand(state) % 100) < config.long_pct;
+    double mean = is_long ? config.long_life : config.short_life;
+    size_t life = (size_t) (-log(1.0 - rand_unit(state)) * mean) + 1;
+    return life < WHEEL_SLOTS ? life : WHEEL_SLOTS - 1;
+}
+
+static void *soak_thread(void *arg)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ULL * ((uintptr_t) arg + 1);
+    size_t ops = config.ops / config.threads;
+
+    struct live_block **wheel = calloc(WHEEL_SLOTS, sizeof(*wheel));
+    if (wheel == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    for (size_t tick = 0; tick < ops; ++tick) {
+        size_t slot = tick % WHEEL_SLOTS;
+        struct live_block *expired = wheel[slot];
+        wheel[slot] = NULL;
+        while (expired != NULL) {
+            struct live_block *next = expired->next;
+            atomic_fetch_sub_explicit(&live_bytes, expired->size,
+                    memory_order_relaxed);
+            free_impl(expired);
+            expired = next;
+        }
+
+        size_t size = sample_size(&state);
+        if (size < sizeof(struct live_block)) {
+            size = sizeof(struct live_block);
+        }
+
+        struct live_block *block = malloc_impl(size, "soak");
+        if (block == NULL) {
+            fprintf(stderr, "soak: allocation of %zu bytes failed\n", size);
+            break;
+        }
+        memset(block, 0x5A, size);
+        block->size = size;
+
+        size_t due = (tick + sample_life(&state)) % WHEEL_SLOTS;
+        block->next = wheel[due];
+        wheel[due] = block;
+        atomic_fetch_add_explicit(&live_bytes, size, memory_order_relaxed);
+
+        if ((tick & 1023) == 1023) {
+            atomic_fetch_add_explicit(&total_ops, 1024, memory_order_relaxed);
+        }
+    }
+
+    for (size_t slot = 0; slot < WHEEL_SLOTS; ++slot) {
+        while (wheel[slot] != NULL) {
+            struct live_block *next = wheel[slot]->next;
+            atomic_fetch_sub_explicit(&live_bytes, wheel[slot]->size,
+                    memory_order_relaxed);
+            free_impl(wheel[slot]);
+            wheel[slot] = next;
+        }
+    }
+
+    free(wheel);
+    return NULL;
+}
+
+static size_t rss_bytes(void)
+{
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) {
+        return 0;
+    }
+
+    unsigned long pages = 0, resident = 0;
+    if (fscanf(statm, "%lu %lu", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+        + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void sample(FILE *out, struct timespec *start)
+{
+    struct alloc_stats stats;
+    allocator_stats(&stats);
+
+    fprintf(out, "%.3f,%zu,%zu,%zu,%zu,%zu,%zu\n",
+            elapsed(start),
+            atomic_load(&total_ops),
+            rss_bytes(),
+            stats.mapped_bytes,
+            atomic_load(&live_bytes),
+            stats.used_bytes,
+            stats.regions);
+    fflush(out);
+}
+
+static void *sampler_thread(void *arg)
+{
+    FILE *out = arg;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct timespec interval = {
+        .tv_sec = config.interval_ms / 1000,
+        .tv_nsec = (config.interval_ms % 1000) * 1000000L,
+    };
+
+    fprintf(out, "seconds,ops,rss_bytes,mapped_bytes,live_bytes,"
+            "used_bytes,regions\n");
+    while (!atomic_load(&done)) {
+        sample(out, &start);
+        nanosleep(&interval, NULL);
+    }
+    sample(out, &start);
+    return NULL;
+}
+
+/**
+ * Prints the average hardware counter deltas per call for each allocator path.
+ */
+static void print_perf(void)
+{
+    struct perf_path_stats stats[PERF_PATH_COUNT];
+    if (!allocator_perf_stats(stats)) {
+        return;
+    }
+
+    fprintf(stderr, "%-8s %12s", "path", "calls");
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        fprintf(stderr, " %12s", perf_counter_name(i));
+    }
+    fputc('\n', stderr);
+
+    for (int p = 0; p < PERF_PATH_COUNT; ++p) {
+        fprintf(stderr, "%-8s %12llu", perf_path_name(p),
+                (unsigned long long) stats[p].calls);
+        for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            double per_call = stats[p].calls == 0 ? 0.0
+                : (double) stats[p].counts[i] / stats[p].calls;
+            fprintf(stderr, " %12.3f", per_call);
+        }
+        fputc('\n', stderr);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n ops] [-t threads] [-s min:max] "
+            "[-l short:long:pct] [-i interval_ms] [-o out.csv]\n"
+            "  -n  total operations across all threads (default %zu)\n"
+            "  -t  worker threads (default %d)\n"
+            "  -s  log-uniform block size range in bytes (default %zu:%zu)\n"
+            "  -l  mean short/long lifetimes in ops and percent long-lived\n"
+            "      (default %zu:%zu:%d)\n"
+            "  -i  sampling interval in milliseconds (default %d)\n"
+            "  -o  CSV output file (default stdout)\n",
+            prog, config.ops, config.threads, config.min_size,
+            config.max_size, config.short_life, config.long_life,
+            config.long_pct, config.interval_ms);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *out = stdout;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:t:s:l:i:o:h")) != -1) {
+        switch (c) {
+            case 'n':
+                config.ops = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                config.threads = atoi(optarg);
+                break;
+            case 's':
+                if (sscanf(optarg, "%zu:%zu",
+                            &config.min_size, &config.max_size) != 2) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'l':
+                if (sscanf(optarg, "%zu:%zu:%d", &config.short_life,
+                            &config.long_life, &config.long_pct) != 3) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'i':
+                config.interval_ms = atoi(optarg);
+                break;
+            case 'o':
+                out = fopen(optarg, "w");
+                if (out == NULL) {
+                    perror("fopen");
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (config.threads < 1 || config.min_size == 0
+            || config.min_size > config.max_size || config.interval_ms < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    pthread_t sampler;
+    pthread_create(&sampler, NULL, sampler_thread, out);
+
+    pthread_t *workers = calloc(config.threads, sizeof(pthread_t));
+    for (long i = 0; i < config.threads; ++i) {
+        pthread_create(&workers[i], NULL, soak_thread, (void *) i);
+    }
+    for (int i = 0; i < config.threads; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    atomic_store(&done, true);
+    pthread_join(sampler, NULL);
+    print_perf();
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,408 @@
+/**
+ * @file
+ *
+ * Stress test and throughput comparison for the structures used to hand memory
+ * between threads: the tagged lock-free stack in lfstack.h against a
+ * mutex-protected doubly-linked list managed the same way as an arena's
+ * free_head list.
+ *
+ * Each thread repeatedly takes a batch of nodes off the shared structure and
+ * puts them back. Every node carries a 'held' flag that is set while a thread
+ * owns it; taking a node that is already held, or losing or duplicating nodes,
+ * means the structure handed out the same memory twice (the ABA problem the
+ * version tag guards against), and the run fails.
+ *
+ * A final phase drives the allocator itself: producer threads allocate blocks
+ * and pass them to consumer threads on another arena, which free them through
+ * the lock-free remote free path. Afterward every block must be accounted for.
+ *
+ * The last phase races pops from the shared pool of empty regions against
+ * regions being unmapped: every thread allocates and frees blocks that fill a
+ * region of their own, with the pool capped at a single region, so most frees
+ * unmap a region that may have just been popped from the pool by another
+ * thread. An unmap that doesn't wait for in-flight pops crashes here.
+ *
+ * Usage:
+ *   ./bench/transfer [-n ops] [-t max_threads] [-b batch] [-c nodes]
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "allocator.h"
+#include "lfstack.h"
+
+struct node {
+    struct lfstack_node link;
+    struct node *next;
+    struct node *prev;
+    atomic_int held;
+};
+
+struct locked_list {
+    pthread_mutex_t lock;
+    struct node *head;
+    struct node *tail;
+};
+
+struct transfer_config {
+    size_t ops;
+    int max_threads;
+    int batch;
+    size_t nodes;
+};
+
+static struct transfer_config config = {
+    .ops = 4 * 1000 * 1000,
+    .max_threads = 8,
+    .batch = 8,
+    .nodes = 4096,
+};
+
+static struct node *nodes;
+static struct lfstack stack;
+static struct locked_list list = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static atomic_size_t violations;
+
+/* Same linking as add_free() / remove_free() on an arena's free list */
+static void list_push(struct node *node)
+{
+    pthread_mutex_lock(&list.lock);
+    node->prev = NULL;
+    node->next = list.head;
+    if (list.head == NULL) {
+        list.tail = node;
+    } else {
+        list.head->prev = node;
+    }
+    list.head = node;
+    pthread_mutex_unlock(&list.lock);
+}
+
+static struct node *list_pop(void)
+{
+    pthread_mutex_lock(&list.lock);
+    struct node *node = list.head;
+    if (node != NULL) {
+        list.head = node->next;
+        if (list.head == NULL) {
+            list.tail = NULL;
+        } else {
+            list.head->prev = NULL;
+        }
+    }
+    pthread_mutex_unlock(&list.lock);
+    return node;
+}
+
+static void stack_push(struct node *node)
+{
+    lfstack_push(&stack, &node->link);
+}
+
+static struct node *stack_pop(void)
+{
+    return (struct node *) lfstack_pop(&stack);
+}
+
+struct structure {
+    const char *name;
+    void (*push)(struct node *node);
+    struct node *(*pop)(void);
+};
+
+static const struct structure structures[] = {
+    { "lfstack", stack_push, stack_pop },
+    { "mutex list", list_push, list_pop },
+};
+
+static const struct structure *current;
+
+static void take(struct node *node)
+{
+    if (atomic_exchange_explicit(&node->held, 1, memory_order_relaxed) != 0) {
+        atomic_fetch_add(&violations, 1);
+    }
+}
+
+static void give(struct node *node)
+{
+    atomic_store_explicit(&node->held, 0, memory_order_relaxed);
+    current->push(node);
+}
+
+static void *transfer_thread(void *arg)
+{
+    size_t ops = (size_t) (uintptr_t) arg;
+    struct node *batch[config.batch];
+
+    for (size_t done = 0; done < ops; ) {
+        int count = 0;
+        while (count < config.batch) {
+            struct node *node = current->pop();
+            if (node == NULL) {
+                break;
+            }
+            take(node);
+            batch[count++] = node;
+        }
+        while (count > 0) {
+            give(batch[--count]);
+            done++;
+        }
+    }
+    return NULL;
+}
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+        + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Drains the structure and checks that every node came back exactly once.
+ */
+static bool verify(void)
+{
+    size_t found = 0;
+    struct node *node;
+    while ((node = current->pop()) != NULL) {
+        take(node);
+        found++;
+    }
+
+    bool ok = found == config.nodes && atomic_load(&violations) == 0;
+    for (size_t i = 0; i < config.nodes; ++i) {
+        atomic_store(&nodes[i].held, 0);
+    }
+    return ok;
+}
+
+static bool run_structure(const struct structure *structure, int threads)
+{
+    current = structure;
+    atomic_store(&violations, 0);
+    for (size_t i = 0; i < config.nodes; ++i) {
+        current->push(&nodes[i]);
+    }
+
+    pthread_t tids[threads];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; ++i) {
+        uintptr_t ops = config.ops / threads;
+        pthread_create(&tids[i], NULL, transfer_thread, (void *) ops);
+    }
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    double seconds = elapsed(&start);
+
+    bool ok = verify();
+    printf("%-12s %3d threads  %12.0f transfers/s  %s\n",
+            structure->name, threads, config.ops / seconds,
+            ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/* -- Allocator phase: cross-thread frees through the remote free stacks -- */
+
+static struct lfstack handoff = LFSTACK_INIT;
+static atomic_size_t handed;
+static atomic_bool producers_done;
+
+static void *producer_thread(void *arg)
+{
+    size_t ops = (size_t) (uintptr_t) arg;
+    for (size_t i = 0; i < ops; ++i) {
+        struct lfstack_node *block = malloc_impl(16 + (i % 32) * 16, "transfer");
+        if (block == NULL) {
+            fprintf(stderr, "transfer: allocation failed\n");
+            break;
+        }
+        lfstack_push(&handoff, block);
+        atomic_fetch_add(&handed, 1);
+    }
+    return NULL;
+}
+
+static void *consumer_thread(void *arg)
+{
+    (void) arg;
+    /* Allocate once so this thread is bound to an arena of its own */
+    free_impl(malloc_impl(1, "consumer"));
+
+    while (true) {
+        struct lfstack_node *block = lfstack_pop(&handoff);
+        if (block != NULL) {
+            free_impl(block);
+            continue;
+        }
+        if (atomic_load(&producers_done) && lfstack_length(&handoff) == 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static bool run_allocator(int threads)
+{
+    int producers = threads > 1 ? threads / 2 : 1;
+    int consumers = threads > 1 ? threads - producers : 1;
+    allocator_set_param(ALLOC_PARAM_ARENA_MAX, producers + consumers);
+    atomic_store(&producers_done, false);
+    atomic_store(&handed, 0);
+
+    struct alloc_stats before;
+    allocator_stats(&before);
+
+    pthread_t tids[producers + consumers];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < producers; ++i) {
+        uintptr_t ops = config.ops / 4 / producers;
+        pthread_create(&tids[i], NULL, producer_thread, (void *) ops);
+    }
+    for (int i = 0; i < consumers; ++i) {
+        pthread_create(&tids[producers + i], NULL, consumer_thread, NULL);
+    }
+    for (int i = 0; i < producers; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    atomic_store(&producers_done, true);
+    for (int i = 0; i < consumers; ++i) {
+        pthread_join(tids[producers + i], NULL);
+    }
+    double seconds = elapsed(&start);
+
+    /* Trimming releases whatever is still pending on the remote stacks */
+    allocator_trim(0);
+    struct alloc_stats after;
+    allocator_stats(&after);
+
+    bool ok = after.used_blocks == before.used_blocks
+        && after.remote_pending == 0;
+    printf("%-12s %3d threads  %12.0f frees/s      %s (%zu remote)\n",
+            "allocator", producers + consumers,
+            atomic_load(&handed) / seconds, ok ? "ok" : "FAILED",
+            after.remote_frees - before.remote_frees);
+    return ok;
+}
+
+/* -- Pool phase: region pool pops racing against unmaps -- */
+
+#define CHURN_BLOCK (96 * 1024)
+
+static void *churn_thread(void *arg)
+{
+    size_t ops = (size_t) (uintptr_t) arg;
+    for (size_t i = 0; i < ops; ++i) {
+        void *block = malloc_impl(CHURN_BLOCK + (i % 8) * 1024, "churn");
+        if (block == NULL) {
+            fprintf(stderr, "transfer: allocation failed\n");
+            break;
+        }
+        free_impl(block);
+    }
+    return NULL;
+}
+
+static bool run_pool(int threads)
+{
+    allocator_set_param(ALLOC_PARAM_ARENA_MAX, threads);
+    allocator_set_param(ALLOC_PARAM_TRIM_THRESHOLD, CHURN_BLOCK + 64 * 1024);
+
+    struct alloc_stats before;
+    allocator_stats(&before);
+
+    pthread_t tids[threads];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; ++i) {
+        uintptr_t ops = config.ops / 64 / threads;
+        pthread_create(&tids[i], NULL, churn_thread, (void *) ops);
+    }
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    double seconds = elapsed(&start);
+
+    allocator_set_param(ALLOC_PARAM_TRIM_THRESHOLD, 128 * 1024);
+    allocator_trim(0);
+    struct alloc_stats after;
+    allocator_stats(&after);
+
+    bool ok = after.used_blocks == before.used_blocks;
+    printf("%-12s %3d threads  %12.0f regions/s    %s (%zu steals, %zu unmaps)\n",
+            "region pool", threads, (config.ops / 64) / seconds,
+            ok ? "ok" : "FAILED", after.region_steals - before.region_steals,
+            after.munmap_count - before.munmap_count);
+    return ok;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n ops] [-t max_threads] [-b batch] [-c nodes]\n"
+            "  -n  total transfers per run (default %zu)\n"
+            "  -t  run with 1, 2, 4, ... up to this many threads (default %d)\n"
+            "  -b  nodes each thread takes per batch (default %d)\n"
+            "  -c  nodes in the shared structure (default %zu)\n",
+            prog, config.ops, config.max_threads, config.batch,
+            config.nodes);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:t:b:c:h")) != -1) {
+        switch (c) {
+            case 'n':
+                config.ops = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                config.max_threads = atoi(optarg);
+                break;
+            case 'b':
+                config.batch = atoi(optarg);
+                break;
+            case 'c':
+                config.nodes = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (config.max_threads < 1 || config.batch < 1 || config.nodes < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    nodes = calloc(config.nodes, sizeof(*nodes));
+    if (nodes == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    bool ok = true;
+    for (int threads = 1; threads <= config.max_threads; threads *= 2) {
+        for (size_t i = 0; i < sizeof(structures) / sizeof(*structures); ++i) {
+            ok &= run_structure(&structures[i], threads);
+        }
+        ok &= run_allocator(threads);
+        ok &= run_pool(threads);
+    }
+
+    free(nodes);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,317 @@
+/**
+ * @file
+ *
+ * Epoch-based reclamation behind free_deferred(). Every thread that uses the
+ * API gets a record holding its announced epoch and three limbo lists, one per
+ * epoch modulo three. The global epoch only advances once every thread inside
+ * a critical section has announced the current epoch, so a block retired in
+ * epoch e can't be reachable by anyone once the global epoch reaches e + 2.
+ * Retired blocks are kept in an array hanging off the limbo list rather than
+ * chained through their data, which readers may still be walking, and each
+ * thread only tries to advance and reclaim after retiring a batch of them.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "epoch.h"
+#include "logger.h"
+
+/* Retirements between attempts to advance the epoch and reclaim */
+#define EPOCH_BATCH 64
+#define EPOCH_LIMBO 3
+/* Set in a record's announced epoch while its thread is in a critical section */
+#define EPOCH_ACTIVE (UINT64_C(1) << 63)
+
+struct limbo {
+    void **blocks;
+    size_t count;
+    size_t capacity;
+    uint64_t epoch;
+};
+
+struct epoch_record {
+    /** Announced epoch | EPOCH_ACTIVE inside a critical section, else 0 */
+    _Atomic uint64_t local;
+    /** Cleared when the owning thread exits so the record can be reused */
+    atomic_bool in_use;
+    unsigned nesting;
+    size_t retired;
+    struct limbo limbo[EPOCH_LIMBO];
+    /** Blocks in the limbo lists, readable by allocator_epoch_stats() */
+    atomic_size_t pending;
+    struct epoch_record *next;
+};
+
+static _Atomic uint64_t global_epoch = 0;
+static struct epoch_record *_Atomic records = NULL;
+static atomic_size_t record_count = 0;
+static atomic_size_t reclaimed = 0;
+static atomic_size_t advances = 0;
+
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct epoch_record *my_record
+    __attribute__((tls_model("initial-exec"))) = NULL;
+
+/**
+ * Thread exit: the record goes back up for grabs. Blocks still in its limbo
+ * lists are freed by the next thread that advances the epoch (see
+ * reclaim_orphans()) or picks the record up.
+ */
+static void record_release(void *arg)
+{
+    struct epoch_record *record = arg;
+    record->nesting = 0;
+    atomic_store(&record->local, 0);
+    atomic_store(&record->in_use, false);
+}
+
+static void record_key_create(void)
+{
+    pthread_key_create(&record_key, record_release);
+}
+
+static struct epoch_record *record_acquire(void)
+{
+    if (my_record != NULL) {
+        return my_record;
+    }
+
+    pthread_once(&record_key_once, record_key_create);
+
+    struct epoch_record *record = atomic_load(&records);
+    while (record != NULL) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&record->in_use, &expected, true)) {
+            break;
+        }
+        record = record->next;
+    }
+
+    if (record == NULL) {
+        record = malloc_impl(sizeof(*record), "epoch record");
+        if (record == NULL) {
+            return NULL;
+        }
+        memset(record, 0, sizeof(*record));
+        atomic_store(&record->in_use, true);
+
+        /* Records are never unlinked, so a plain CAS push can't hit ABA */
+        struct epoch_record *head = atomic_load(&records);
+        do {
+            record->next = head;
+        } while (!atomic_compare_exchange_weak(&records, &head, record));
+        atomic_fetch_add(&record_count, 1);
+    }
+
+    pthread_setspecific(record_key, record);
+    my_record = record;
+    return record;
+}
+
+void epoch_enter(void)
+{
+    struct epoch_record *record = record_acquire();
+    if (record == NULL || record->nesting++ > 0) {
+        return;
+    }
+
+    atomic_store(&record->local, atomic_load(&global_epoch) | EPOCH_ACTIVE);
+    /* The announcement must be visible before we read the data structure */
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void)
+{
+    struct epoch_record *record = my_record;
+    if (record == NULL || record->nesting == 0) {
+        LOGP("epoch_exit() without epoch_enter()\n");
+        return;
+    }
+
+    if (--record->nesting == 0) {
+        atomic_store_explicit(&record->local, 0, memory_order_release);
+    }
+}
+
+/**
+ * Moves the global epoch forward if every thread in a critical section has
+ * caught up with it.
+ */
+static bool try_advance(void)
+{
+    uint64_t epoch = atomic_load(&global_epoch);
+
+    for (struct epoch_record *record = atomic_load(&records);
+            record != NULL; record = record->next) {
+        uint64_t local = atomic_load(&record->local);
+        if ((local & EPOCH_ACTIVE) && (local & ~EPOCH_ACTIVE) != epoch) {
+            return false;
+        }
+    }
+
+    if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1)) {
+        atomic_fetch_add(&advances, 1);
+    }
+    return true;
+}
+
+/**
+ * Frees the blocks on a limbo list. The list's array is kept for the next
+ * epoch that lands on it.
+ */
+static void free_limbo(struct epoch_record *record, struct limbo *limbo)
+{
+    for (size_t i = 0; i < limbo->count; ++i) {
+        free_impl(limbo->blocks[i]);
+    }
+
+    atomic_fetch_sub(&record->pending, limbo->count);
+    atomic_fetch_add(&reclaimed, limbo->count);
+    limbo->count = 0;
+}
+
+/**
+ * Makes room for one more block on a limbo list, doubling its array.
+ */
+static bool limbo_reserve(struct limbo *limbo)
+{
+    if (limbo->count < limbo->capacity) {
+        return true;
+    }
+
+    size_t capacity = limbo->capacity > 0 ? limbo->capacity * 2 : EPOCH_BATCH;
+    void **blocks = reallocarray_impl(limbo->blocks, capacity,
+            sizeof(*blocks), "epoch limbo");
+    if (blocks == NULL) {
+        return false;
+    }
+    limbo->blocks = blocks;
+    limbo->capacity = capacity;
+    return true;
+}
+
+/**
+ * Frees every limbo list of 'record' whose grace period has ended.
+ */
+static void reclaim(struct epoch_record *record)
+{
+    uint64_t epoch = atomic_load(&global_epoch);
+    for (int i = 0; i < EPOCH_LIMBO; ++i) {
+        struct limbo *limbo = &record->limbo[i];
+        if (limbo->count > 0 && limbo->epoch + 2 <= epoch) {
+            free_limbo(record, limbo);
+        }
+    }
+}
+
+/**
+ * Frees the limbo lists whose grace period has ended in the records of threads
+ * that exited. Each record is claimed while it's reclaimed, so a new thread
+ * can't pick it up halfway.
+ *
+ * @return blocks still waiting in records no thread owns
+ */
+static size_t reclaim_orphans(void)
+{
+    size_t left = 0;
+    for (struct epoch_record *record = atomic_load(&records);
+            record != NULL; record = record->next) {
+        bool expected = false;
+        if (atomic_load(&record->pending) == 0
+                || !atomic_compare_exchange_strong(&record->in_use, &expected,
+                    true)) {
+            continue;
+        }
+        reclaim(record);
+        left += atomic_load(&record->pending);
+        atomic_store(&record->in_use, false);
+    }
+    return left;
+}
+
+void free_deferred(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    struct epoch_record *record = record_acquire();
+    if (record == NULL) {
+        LOG("no epoch record for deferred free of %p, leaking it\n", ptr);
+        return;
+    }
+
+    /* Read after the caller unlinked 'ptr': anyone who can still reach it
+     * announced this epoch or an older one. */
+    uint64_t epoch = atomic_load(&global_epoch);
+    struct limbo *limbo = &record->limbo[epoch % EPOCH_LIMBO];
+    if (limbo->count > 0 && limbo->epoch != epoch) {
+        /* Left over from three or more epochs ago */
+        free_limbo(record, limbo);
+    }
+
+    if (!limbo_reserve(limbo)) {
+        LOG("no room to retire %p, leaking it\n", ptr);
+        return;
+    }
+
+    limbo->epoch = epoch;
+    limbo->blocks[limbo->count++] = ptr;
+    atomic_fetch_add(&record->pending, 1);
+
+    if (++record->retired >= EPOCH_BATCH) {
+        record->retired = 0;
+        if (try_advance()) {
+            reclaim_orphans();
+        }
+        reclaim(record);
+    }
+}
+
+void free_deferred_flush(void)
+{
+    struct epoch_record *record = my_record;
+    if (record == NULL) {
+        return;
+    }
+    if (record->nesting > 0) {
+        LOGP("free_deferred_flush() inside a critical section\n");
+        return;
+    }
+
+    record->retired = 0;
+    while (atomic_load(&record->pending) > 0) {
+        if (!try_advance()) {
+            sched_yield();
+        }
+        reclaim(record);
+    }
+
+    /* Exited threads left their limbo lists to us */
+    while (reclaim_orphans() > 0) {
+        if (!try_advance()) {
+            sched_yield();
+        }
+    }
+}
+
+void allocator_epoch_stats(struct epoch_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->epoch = atomic_load(&global_epoch);
+    stats->threads = atomic_load(&record_count);
+    stats->reclaimed_blocks = atomic_load(&reclaimed);
+    stats->advances = atomic_load(&advances);
+
+    for (struct epoch_record *record = atomic_load(&records);
+            record != NULL; record = record->next) {
+        stats->pending_blocks += atomic_load(&record->pending);
+    }
+}
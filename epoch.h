@@ -0,0 +1,53 @@
+/**
+ * @file
+ *
+ * Epoch-based deferred freeing for lock-free data structures. Readers bracket
+ * their accesses with epoch_enter()/epoch_exit(); a writer that unlinks a node
+ * passes it to free_deferred() instead of free_impl(). The block sits on the
+ * retiring thread's limbo list until every thread has been seen outside of (or
+ * in a newer) critical section, i.e. a grace period has passed, and is then
+ * released with free_impl() together with the rest of its batch.
+ */
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct epoch_stats {
+    /** Current global epoch */
+    uint64_t epoch;
+    /** Threads that have used the epoch API (records are reused on exit) */
+    size_t threads;
+    /** Blocks retired with free_deferred() and not yet freed */
+    size_t pending_blocks;
+    /** Blocks freed after their grace period ended */
+    size_t reclaimed_blocks;
+    /** Times the global epoch was advanced */
+    size_t advances;
+};
+
+/**
+ * Starts a read-side critical section. Blocks retired by any thread after this
+ * call won't be freed until the matching epoch_exit(). Sections may nest.
+ */
+void epoch_enter(void);
+void epoch_exit(void);
+
+/**
+ * Frees a block from malloc_impl() once no critical section that might still
+ * be reading it is running. Safe to call inside or outside a critical section.
+ */
+void free_deferred(void *ptr);
+
+/**
+ * Waits for a grace period and frees every block the calling thread has
+ * retired, along with those left behind by threads that exited. Must not be
+ * called inside a critical section.
+ */
+void free_deferred_flush(void);
+
+void allocator_epoch_stats(struct epoch_stats *stats);
+
+#endif
@@ -0,0 +1,569 @@
+/**
+ * @file
+ *
+ * Mark phase of the conservative leak scan. The used blocks are collected into
+ * an address-sorted table; root memory (every readable, writable mapping minus
+ * the allocator's regions) is cut into chunks that worker threads claim one at
+ * a time. Each worker marks the blocks its words point into with an atomic
+ * exchange, so every block is scanned by exactly one worker, and follows them
+ * depth-first through its own mark stack. The heap is walked in chunks with
+ * allocator_iterate(), so other threads only wait for one chunk at a time.
+ * All scan memory comes from mmap(): the iteration holds arena locks, and the
+ * scan's own tables must not be mistaken for roots.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "leak_scan.h"
+
+#define SCAN_MAX_THREADS 16
+/* Root memory is handed out to workers in pieces of this many bytes */
+#define SCAN_CHUNK (1024 * 1024)
+#define SCAN_ARRAY_INITIAL 4096
+/* Blocks collected or reported per arena lock hold */
+#define SCAN_WALK_BLOCKS 4096
+
+/** Growable array backed by its own mapping */
+struct scan_array {
+    char *data;
+    size_t count;
+    size_t capacity;
+    size_t elem_size;
+};
+
+struct scan_range {
+    uintptr_t start;
+    uintptr_t end;
+};
+
+struct scan {
+    /** Data of every used block, sorted by address */
+    struct scan_array blocks;
+    /** Memory that isn't a root: regions and the scan's own tables */
+    struct scan_array excluded;
+    /** Root memory, in chunks of at most SCAN_CHUNK bytes */
+    struct scan_array roots;
+    atomic_uchar *marks;
+    size_t marks_size;
+
+    atomic_size_t next_root;
+    uintptr_t lowest;
+    uintptr_t highest;
+    atomic_bool incomplete;
+};
+
+struct scan_worker {
+    struct scan *scan;
+    /** Indexes of marked blocks whose contents haven't been scanned yet */
+    struct scan_array stack;
+    pthread_t thread;
+};
+
+/* An unreachable block, recorded during the walk and printed after it */
+struct leak_entry {
+    struct mem_block *block;
+    size_t size;
+    void *site;
+    char name[ALLOC_NAME_MAX + 1];
+};
+
+struct scan_report {
+    struct scan *scan;
+    /** Unreachable blocks (struct leak_entry), printed once the walk ends */
+    struct scan_array leaks;
+    size_t unreachable;
+    size_t unreachable_bytes;
+    size_t reachable;
+};
+
+static void *array_push(struct scan_array *array)
+{
+    if (array->count == array->capacity) {
+        size_t capacity = array->capacity == 0
+            ? SCAN_ARRAY_INITIAL : array->capacity * 2;
+        void *data = array->data == NULL
+            ? mmap(NULL, capacity * array->elem_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+            : mremap(array->data, array->capacity * array->elem_size,
+                    capacity * array->elem_size, MREMAP_MAYMOVE);
+        if (data == MAP_FAILED) {
+            return NULL;
+        }
+        array->data = data;
+        array->capacity = capacity;
+    }
+    return array->data + array->count++ * array->elem_size;
+}
+
+static void *array_at(struct scan_array *array, size_t index)
+{
+    return array->data + index * array->elem_size;
+}
+
+static void array_free(struct scan_array *array)
+{
+    if (array->data != NULL) {
+        munmap(array->data, array->capacity * array->elem_size);
+    }
+    array->data = NULL;
+    array->count = array->capacity = 0;
+}
+
+static bool add_range(struct scan_array *array, uintptr_t start, uintptr_t end)
+{
+    struct scan_range *range = array_push(array);
+    if (range == NULL) {
+        return false;
+    }
+    range->start = start;
+    range->end = end;
+    return true;
+}
+
+/* Moves ranges[root] down the max-heap of the first 'count' ranges */
+static void sift_down(struct scan_range *ranges, size_t root, size_t count)
+{
+    struct scan_range range = ranges[root];
+    size_t child;
+    while ((child = 2 * root + 1) < count) {
+        if (child + 1 < count
+                && ranges[child + 1].start > ranges[child].start) {
+            child++;
+        }
+        if (ranges[child].start <= range.start) {
+            break;
+        }
+        ranges[root] = ranges[child];
+        root = child;
+    }
+    ranges[root] = range;
+}
+
+/**
+ * Sorts ranges by start address with an in-place heapsort. qsort() may
+ * malloc a copy of the table, and a copy outside the scan's own mappings
+ * would be scanned as a root that points into every block.
+ */
+static void sort_ranges(struct scan_range *ranges, size_t count)
+{
+    for (size_t i = count / 2; i > 0; --i) {
+        sift_down(ranges, i - 1, count);
+    }
+    for (size_t end = count; end > 1; --end) {
+        struct scan_range top = ranges[0];
+        ranges[0] = ranges[end - 1];
+        ranges[end - 1] = top;
+        sift_down(ranges, 0, end - 1);
+    }
+}
+
+/**
+ * Finds the block whose data contains 'addr'.
+ *
+ * @return index into scan->blocks, or -1 if 'addr' isn't in any used block
+ */
+static ssize_t find_block(struct scan *scan, uintptr_t addr)
+{
+    struct scan_range *blocks = (struct scan_range *) scan->blocks.data;
+    size_t low = 0, high = scan->blocks.count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (blocks[mid].start <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0 || addr >= blocks[low - 1].end) {
+        return -1;
+    }
+    return low - 1;
+}
+
+static void collect_block(const struct alloc_block_info *info, void *arg)
+{
+    struct scan *scan = arg;
+
+    /* Blocks of a region are visited in a row, so a new region shows up as a
+     * change from the last one recorded */
+    uintptr_t region = (uintptr_t) info->region;
+    struct scan_range *last = scan->excluded.count == 0 ? NULL
+        : array_at(&scan->excluded, scan->excluded.count - 1);
+    if (last == NULL || last->start != region) {
+        if (!add_range(&scan->excluded, region, region + info->region_size)) {
+            scan->incomplete = true;
+        }
+    }
+
+    if (info->state == ALLOC_BLOCK_USED) {
+        uintptr_t start = (uintptr_t) info->ptr;
+        uintptr_t end = start + info->size - sizeof(struct mem_block);
+        if (!add_range(&scan->blocks, start, end)) {
+            scan->incomplete = true;
+        }
+    }
+}
+
+static uintptr_t parse_hex(const char **pos)
+{
+    uintptr_t value = 0;
+    for (;;) {
+        char c = **pos;
+        if (c >= '0' && c <= '9') {
+            value = value * 16 + (c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            value = value * 16 + (c - 'a' + 10);
+        } else {
+            return value;
+        }
+        (*pos)++;
+    }
+}
+
+/**
+ * Adds [start, end) to the roots, minus the excluded ranges and split into
+ * chunks.
+ */
+static void add_root(struct scan *scan, uintptr_t start, uintptr_t end)
+{
+    struct scan_range *excluded = (struct scan_range *) scan->excluded.data;
+    for (size_t i = 0; i < scan->excluded.count && start < end; ++i) {
+        if (excluded[i].end <= start) {
+            continue;
+        }
+        if (excluded[i].start >= end) {
+            break;
+        }
+        if (excluded[i].start > start) {
+            add_root(scan, start, excluded[i].start);
+        }
+        start = excluded[i].end;
+    }
+
+    while (start < end) {
+        uintptr_t chunk_end = end - start > SCAN_CHUNK ? start + SCAN_CHUNK : end;
+        if (!add_range(&scan->roots, start, chunk_end)) {
+            scan->incomplete = true;
+            return;
+        }
+        start = chunk_end;
+    }
+}
+
+/**
+ * Handles one line of /proc/self/maps. Only private or shared writable
+ * mappings can hold pointers to the heap; device mappings and the kernel's
+ * special areas are skipped because reading them may fault or have effects.
+ * The calling thread's stack is only scanned from 'stack_top' up, leaving out
+ * stale data below its stack pointer.
+ */
+static void add_mapping(struct scan *scan, const char *line, uintptr_t stack_top)
+{
+    const char *pos = line;
+    uintptr_t start = parse_hex(&pos);
+    if (*pos++ != '-') {
+        return;
+    }
+    uintptr_t end = parse_hex(&pos);
+    if (*pos++ != ' ' || pos[0] != 'r' || pos[1] != 'w') {
+        return;
+    }
+
+    /* Skip perms, offset, dev, and inode to reach the path (if any) */
+    for (int field = 0; field < 4; ++field) {
+        while (*pos == ' ') {
+            pos++;
+        }
+        while (*pos != ' ' && *pos != '\0') {
+            pos++;
+        }
+    }
+    while (*pos == ' ') {
+        pos++;
+    }
+    if (strncmp(pos, "/dev/", 5) == 0 || strcmp(pos, "[vvar]") == 0
+            || strcmp(pos, "[vsyscall]") == 0) {
+        return;
+    }
+
+    if (stack_top >= start && stack_top < end) {
+        start = stack_top & ~(uintptr_t) (sizeof(void *) - 1);
+    }
+    add_root(scan, start, end);
+}
+
+static bool collect_roots(struct scan *scan, uintptr_t stack_top)
+{
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open");
+        return false;
+    }
+
+    char buf[4096];
+    size_t used = 0;
+    ssize_t len;
+    while ((len = read(fd, buf + used, sizeof(buf) - 1 - used)) > 0) {
+        used += len;
+        buf[used] = '\0';
+
+        char *line = buf;
+        char *newline;
+        while ((newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+            add_mapping(scan, line, stack_top);
+            line = newline + 1;
+        }
+        used = buf + used - line;
+        memmove(buf, line, used);
+    }
+
+    close(fd);
+    return true;
+}
+
+static void mark_word(struct scan_worker *worker, uintptr_t value)
+{
+    struct scan *scan = worker->scan;
+    if (value < scan->lowest || value >= scan->highest) {
+        return;
+    }
+
+    ssize_t index = find_block(scan, value);
+    if (index < 0 || atomic_exchange_explicit(&scan->marks[index], 1,
+                memory_order_relaxed)) {
+        return;
+    }
+
+    size_t *slot = array_push(&worker->stack);
+    if (slot == NULL) {
+        /* Blocks only reachable through this one may be reported */
+        scan->incomplete = true;
+        return;
+    }
+    *slot = index;
+}
+
+static void scan_range(struct scan_worker *worker, uintptr_t start,
+        uintptr_t end)
+{
+    start = (start + sizeof(void *) - 1) & ~(uintptr_t) (sizeof(void *) - 1);
+    for (uintptr_t addr = start; addr + sizeof(void *) <= end;
+            addr += sizeof(void *)) {
+        mark_word(worker, *(volatile uintptr_t *) addr);
+    }
+}
+
+static void *scan_worker_run(void *arg)
+{
+    struct scan_worker *worker = arg;
+    struct scan *scan = worker->scan;
+
+    size_t root;
+    while ((root = atomic_fetch_add(&scan->next_root, 1)) < scan->roots.count) {
+        struct scan_range *range = array_at(&scan->roots, root);
+        scan_range(worker, range->start, range->end);
+
+        while (worker->stack.count > 0) {
+            size_t index = *(size_t *) array_at(&worker->stack,
+                    --worker->stack.count);
+            struct scan_range *block = array_at(&scan->blocks, index);
+            scan_range(worker, block->start, block->end);
+        }
+    }
+    return NULL;
+}
+
+static void report_block(const struct alloc_block_info *info, void *arg)
+{
+    struct scan_report *report = arg;
+    if (info->state != ALLOC_BLOCK_USED) {
+        return;
+    }
+
+    /* Blocks allocated since the table was built weren't scanned */
+    ssize_t index = find_block(report->scan, (uintptr_t) info->ptr);
+    if (index < 0) {
+        return;
+    }
+    if (report->scan->marks[index]) {
+        report->reachable++;
+        return;
+    }
+
+    /* The walk holds an arena lock, and printing may allocate: only record
+     * the block here */
+    struct leak_entry *leak = array_push(&report->leaks);
+    if (leak != NULL) {
+        leak->block = (struct mem_block *) info->ptr - 1;
+        leak->size = info->size;
+        leak->site = info->site;
+        strncpy(leak->name, info->name, ALLOC_NAME_MAX);
+        leak->name[ALLOC_NAME_MAX] = '\0';
+    } else {
+        report->scan->incomplete = true;
+    }
+    report->unreachable++;
+    report->unreachable_bytes += info->size;
+}
+
+static void print_leaks(struct scan_report *report)
+{
+    for (size_t i = 0; i < report->leaks.count; ++i) {
+        struct leak_entry *leak = array_at(&report->leaks, i);
+        if (leak->site != NULL) {
+            dprintf(STDOUT_FILENO, "[BLOCK %p] %-7zu '%s' (site %p)\n",
+                    leak->block, leak->size, leak->name, leak->site);
+        } else {
+            dprintf(STDOUT_FILENO, "[BLOCK %p] %-7zu '%s'\n", leak->block,
+                    leak->size, leak->name);
+        }
+    }
+}
+
+static int scan_threads(int threads)
+{
+    if (threads <= 0) {
+        cpu_set_t cpus;
+        threads = sched_getaffinity(0, sizeof(cpus), &cpus) == 0
+            ? CPU_COUNT(&cpus) : 1;
+    }
+    return threads < SCAN_MAX_THREADS ? threads : SCAN_MAX_THREADS;
+}
+
+/**
+ * Runs the scan from a frame below leak_scan(), so the registers it spilled
+ * lie inside the part of the stack that gets scanned.
+ */
+static __attribute__((noinline)) void run_scan(struct scan *scan, int threads)
+{
+    uintptr_t stack_top = (uintptr_t) __builtin_frame_address(0);
+
+    if (!collect_roots(scan, stack_top)) {
+        scan->incomplete = true;
+    }
+
+    struct scan_worker workers[SCAN_MAX_THREADS];
+    for (int i = 0; i < threads; ++i) {
+        workers[i] = (struct scan_worker) {
+            .scan = scan,
+            .stack = { .elem_size = sizeof(size_t) },
+        };
+    }
+
+    /* The calling thread is worker 0 */
+    int started = 1;
+    for (int i = 1; i < threads; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, scan_worker_run,
+                    &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    scan_worker_run(&workers[0]);
+    for (int i = 1; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < threads; ++i) {
+        array_free(&workers[i].stack);
+    }
+}
+
+static void heap_iterate(
+        void (*visit)(const struct alloc_block_info *info, void *arg),
+        void *arg)
+{
+    struct alloc_cursor cursor;
+    allocator_iterate_begin(&cursor);
+    while (allocator_iterate(&cursor, SCAN_WALK_BLOCKS, visit, arg) > 0) {
+    }
+    allocator_iterate_end(&cursor);
+}
+
+size_t leak_scan(int threads)
+{
+    fflush(stdout);
+
+    struct scan scan = {
+        .blocks = { .elem_size = sizeof(struct scan_range) },
+        .excluded = { .elem_size = sizeof(struct scan_range) },
+        .roots = { .elem_size = sizeof(struct scan_range) },
+    };
+
+    heap_iterate(collect_block, &scan);
+    sort_ranges((struct scan_range *) scan.blocks.data, scan.blocks.count);
+
+    struct scan_report report = {
+        .scan = &scan,
+        .leaks = { .elem_size = sizeof(struct leak_entry) },
+    };
+    if (scan.blocks.count > 0) {
+        struct scan_range *blocks = (struct scan_range *) scan.blocks.data;
+        scan.lowest = blocks[0].start;
+        scan.highest = blocks[scan.blocks.count - 1].end;
+
+        scan.marks_size = scan.blocks.count;
+        scan.marks = mmap(NULL, scan.marks_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (scan.marks == MAP_FAILED) {
+            perror("mmap");
+            array_free(&scan.blocks);
+            array_free(&scan.excluded);
+            return 0;
+        }
+
+        /* The block table holds pointers to every block; don't scan it */
+        if (!add_range(&scan.excluded, (uintptr_t) scan.blocks.data,
+                    (uintptr_t) scan.blocks.data
+                    + scan.blocks.capacity * scan.blocks.elem_size)) {
+            scan.incomplete = true;
+        }
+        sort_ranges((struct scan_range *) scan.excluded.data,
+                scan.excluded.count);
+
+        /* Spill callee-saved registers onto the stack */
+        jmp_buf registers;
+        __builtin_unwind_init();
+        setjmp(registers);
+        run_scan(&scan, scan_threads(threads));
+        /* Keep the spilled registers live until the scan is done */
+        __asm__ volatile("" : : "r"(&registers) : "memory");
+    }
+
+    dprintf(STDOUT_FILENO, "-- Unreachable Blocks --\n");
+    if (scan.blocks.count > 0) {
+        heap_iterate(report_block, &report);
+        print_leaks(&report);
+    }
+
+    dprintf(STDOUT_FILENO, "\n-- Summary --\n");
+    dprintf(STDOUT_FILENO, "%zu blocks unreachable (%zu bytes), %zu reachable\n",
+            report.unreachable, report.unreachable_bytes, report.reachable);
+    if (scan.incomplete) {
+        dprintf(STDOUT_FILENO,
+                "(incomplete: ran out of memory for scan tables)\n");
+    }
+
+    if (scan.marks != NULL) {
+        munmap(scan.marks, scan.marks_size);
+    }
+    array_free(&scan.blocks);
+    array_free(&scan.excluded);
+    array_free(&scan.roots);
+    array_free(&report.leaks);
+    return report.unreachable;
+}
@@ -0,0 +1,37 @@
+/**
+ * @file
+ *
+ * Conservative reachability-based leak detection. Where leak_check() reports
+ * every block that is still allocated, leak_scan() only reports blocks that
+ * nothing points to anymore: it treats the stacks, the calling thread's
+ * registers, writable data/bss segments, and every other writable mapping
+ * outside the heap as roots, marks all blocks reachable from them (directly or
+ * through other reachable blocks), and prints the allocated blocks left
+ * unmarked along with their tags.
+ *
+ * Any word that looks like a pointer into a block's data counts, so the scan
+ * can miss leaks but won't report a reachable block. Other threads should be
+ * idle while it runs: their registers aren't captured and blocks they allocate
+ * or free during the scan aren't tracked.
+ */
+
+#ifndef LEAK_SCAN_H
+#define LEAK_SCAN_H
+
+#include <stddef.h>
+
+/**
+ * Scans for unreachable blocks using up to 'threads' threads (0 picks one per
+ * CPU) and prints each one to stdout, like leak_check():
+ *
+ * -- Unreachable Blocks --
+ * [BLOCK 0x7f0d774e7000] 168     'First Allocation'
+ *
+ * -- Summary --
+ * 1 blocks unreachable (168 bytes), 542 reachable
+ *
+ * @return number of unreachable blocks
+ */
+size_t leak_scan(int threads);
+
+#endif
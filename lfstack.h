@@ -0,0 +1,180 @@
+/**
+ * @file
+ *
+ * ABA-safe lock-free intrusive stack (a Treiber stack with a version tag) used
+ * to hand regions and blocks between threads without taking a lock.
+ *
+ * The head packs a node pointer together with a 16-bit tag in the upper address
+ * bits, which are unused with 48-bit virtual addresses (x86-64, AArch64). Every
+ * update bumps the tag, so a pop that read the head before another thread
+ * popped and re-pushed the same node fails its CAS instead of corrupting the
+ * stack. Nodes must therefore live below LFSTACK_PTR_MASK; memory that will
+ * hold them is checked with lfstack_fits() when it is mapped.
+ *
+ * A pop may still read the 'next' pointer of a node that another thread has
+ * already taken, so nodes must stay mapped while pops are in flight. Pops are
+ * counted; after lfstack_take_all(), lfstack_quiesce() waits for them to finish
+ * so the nodes that were taken can safely be unmapped.
+ */
+
+#ifndef LFSTACK_H
+#define LFSTACK_H
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LFSTACK_TAG_SHIFT 48
+#define LFSTACK_PTR_MASK ((UINT64_C(1) << LFSTACK_TAG_SHIFT) - 1)
+
+_Static_assert(sizeof(uintptr_t) <= sizeof(uint64_t),
+        "an lfstack head must hold a whole pointer");
+
+struct lfstack_node {
+    struct lfstack_node *next;
+};
+
+struct lfstack {
+    /** Top node pointer and version tag */
+    _Atomic uint64_t head;
+    /** Number of pops currently reading nodes */
+    atomic_size_t poppers;
+    /** Number of nodes on the stack */
+    atomic_size_t length;
+};
+
+#define LFSTACK_INIT { 0, 0, 0 }
+
+/**
+ * Tells whether nodes anywhere in [addr, addr + size) can be pushed, i.e. the
+ * range lies entirely below the tag bits. Even with 5-level paging, Linux only
+ * maps memory above 47 bits for mmap() calls whose hint address asks for it,
+ * so this fails only for such mappings.
+ */
+static inline bool lfstack_fits(const void *addr, size_t size)
+{
+    return size == 0 || (uintptr_t) addr + (size - 1) <= LFSTACK_PTR_MASK;
+}
+
+static inline struct lfstack_node *lfstack_ptr(uint64_t head)
+{
+    return (struct lfstack_node *) (uintptr_t) (head & LFSTACK_PTR_MASK);
+}
+
+/**
+ * Builds a new head pointing at 'node' with the tag of 'old' incremented.
+ */
+static inline uint64_t lfstack_pack(struct lfstack_node *node, uint64_t old)
+{
+    uint64_t tag = (old >> LFSTACK_TAG_SHIFT) + 1;
+    return (uintptr_t) node | (tag << LFSTACK_TAG_SHIFT);
+}
+
+static inline void lfstack_push(struct lfstack *stack, struct lfstack_node *node)
+{
+    uint64_t old = atomic_load_explicit(&stack->head, memory_order_relaxed);
+    do {
+        node->next = lfstack_ptr(old);
+    } while (!atomic_compare_exchange_weak_explicit(&stack->head, &old,
+                lfstack_pack(node, old),
+                memory_order_release, memory_order_relaxed));
+    atomic_fetch_add_explicit(&stack->length, 1, memory_order_relaxed);
+}
+
+/**
+ * Pushes a chain of nodes (already linked through 'next', ending at 'last') in
+ * a single CAS.
+ */
+static inline void lfstack_push_chain(struct lfstack *stack,
+        struct lfstack_node *first, struct lfstack_node *last, size_t count)
+{
+    uint64_t old = atomic_load_explicit(&stack->head, memory_order_relaxed);
+    do {
+        last->next = lfstack_ptr(old);
+    } while (!atomic_compare_exchange_weak_explicit(&stack->head, &old,
+                lfstack_pack(first, old),
+                memory_order_release, memory_order_relaxed));
+    atomic_fetch_add_explicit(&stack->length, count, memory_order_relaxed);
+}
+
+/**
+ * Pops the top node, or returns NULL if the stack is empty.
+ *
+ * The tag is 16 bits wide and wraps after 65536 updates of the head. A pop
+ * that stalls between loading the head and its CAS while exactly a multiple of
+ * 65536 pushes and pops complete, leaving the same node on top, would still
+ * succeed and install a stale 'next'. Every one of those updates has to happen
+ * inside that one window, so this is only a concern if a popping thread can be
+ * descheduled for that long with the stack under heavy traffic.
+ */
+static inline struct lfstack_node *lfstack_pop(struct lfstack *stack)
+{
+    atomic_fetch_add_explicit(&stack->poppers, 1, memory_order_acquire);
+
+    struct lfstack_node *node;
+    uint64_t old = atomic_load_explicit(&stack->head, memory_order_acquire);
+    do {
+        node = lfstack_ptr(old);
+        if (node == NULL) {
+            break;
+        }
+        /* If 'node' is taken before our CAS, the tag makes the CAS fail, so
+         * a stale 'next' is never installed. */
+    } while (!atomic_compare_exchange_weak_explicit(&stack->head, &old,
+                lfstack_pack(node->next, old),
+                memory_order_acquire, memory_order_acquire));
+
+    atomic_fetch_sub_explicit(&stack->poppers, 1, memory_order_release);
+
+    if (node != NULL) {
+        atomic_fetch_sub_explicit(&stack->length, 1, memory_order_relaxed);
+    }
+    return node;
+}
+
+/**
+ * Detaches the whole stack in one operation and returns its nodes as a chain.
+ * Only the caller can see the returned nodes, so walking them needs no further
+ * synchronization.
+ */
+static inline struct lfstack_node *lfstack_take_all(struct lfstack *stack)
+{
+    uint64_t old = atomic_load_explicit(&stack->head, memory_order_relaxed);
+    while (lfstack_ptr(old) != NULL
+            && !atomic_compare_exchange_weak_explicit(&stack->head, &old,
+                lfstack_pack(NULL, old),
+                memory_order_acquire, memory_order_relaxed)) {
+    }
+
+    struct lfstack_node *chain = lfstack_ptr(old);
+    if (chain == NULL) {
+        return NULL;
+    }
+
+    size_t count = 0;
+    for (struct lfstack_node *node = chain; node != NULL; node = node->next) {
+        count++;
+    }
+    atomic_fetch_sub_explicit(&stack->length, count, memory_order_relaxed);
+    return chain;
+}
+
+/**
+ * Waits until no pop that started before this call can still be reading a
+ * node. Call after lfstack_take_all() and before unmapping the nodes taken.
+ */
+static inline void lfstack_quiesce(struct lfstack *stack)
+{
+    while (atomic_load_explicit(&stack->poppers, memory_order_acquire) != 0) {
+        sched_yield();
+    }
+}
+
+static inline size_t lfstack_length(struct lfstack *stack)
+{
+    return atomic_load_explicit(&stack->length, memory_order_relaxed);
+}
+
+#endif
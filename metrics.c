@@ -0,0 +1,297 @@
+/**
+ * @file
+ *
+ * Prometheus text-format exporter for allocator_stats(). The exposition text
+ * is formatted into a fixed-size buffer mapped with mmap(), and only integer
+ * conversions are used (fractions are printed as "%zu.%09zu" from integer
+ * parts), so nothing here calls into the heap being measured.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "logger.h"
+#include "metrics.h"
+
+/* Room for every metric with plenty to spare */
+#define METRICS_BUFFER (64 * 1024)
+
+struct metrics_text {
+    char *data;
+    size_t len;
+    bool truncated;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    bool running;
+    bool stop;
+    unsigned int interval;
+    char path[PATH_MAX];
+} exporter = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+static void emit(struct metrics_text *text, const char *fmt, ...)
+{
+    if (text->truncated) {
+        return;
+    }
+
+    size_t room = METRICS_BUFFER - text->len;
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(text->data + text->len, room, fmt, args);
+    va_end(args);
+
+    if (len < 0 || (size_t) len >= room) {
+        text->truncated = true;
+        return;
+    }
+    text->len += len;
+}
+
+static void describe(struct metrics_text *text, const char *name,
+        const char *type, const char *help)
+{
+    emit(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void gauge(struct metrics_text *text, const char *name,
+        const char *help, size_t value)
+{
+    describe(text, name, "gauge", help);
+    emit(text, "%s %zu\n", name, value);
+}
+
+static void counter(struct metrics_text *text, const char *name,
+        const char *help, size_t value)
+{
+    describe(text, name, "counter", help);
+    emit(text, "%s %zu\n", name, value);
+}
+
+static void class_series(struct metrics_text *text, const char *name,
+        const char *help, const struct alloc_stats *stats, size_t offset)
+{
+    describe(text, name, "gauge", help);
+    for (int i = 0; i < ALLOC_SIZE_CLASSES; ++i) {
+        size_t lower = i == 0 ? 0 : alloc_size_class_limit(i - 1) + 1;
+        size_t value = *(const size_t *)
+            ((const char *) &stats->classes[i] + offset);
+        if (i == ALLOC_SIZE_CLASSES - 1) {
+            emit(text, "%s{class=\"%zu+\"} %zu\n", name, lower, value);
+        } else {
+            emit(text, "%s{class=\"%zu-%zu\"} %zu\n", name, lower,
+                    alloc_size_class_limit(i), value);
+        }
+    }
+}
+
+static void format_stats(struct metrics_text *text,
+        const struct alloc_stats *stats)
+{
+    gauge(text, "allocator_mapped_bytes",
+            "Bytes mapped from the OS, including pooled regions.",
+            stats->mapped_bytes);
+    gauge(text, "allocator_used_bytes",
+            "Bytes in used blocks (header + data).", stats->used_bytes);
+    gauge(text, "allocator_free_bytes",
+            "Bytes in free blocks (header + data).", stats->free_bytes);
+    gauge(text, "allocator_parked_bytes",
+            "Bytes in freed blocks held by thread caches or remote frees.",
+            stats->parked_bytes);
+    gauge(text, "allocator_resident_bytes",
+            "Bytes of arena regions resident in memory.",
+            stats->resident_bytes);
+    gauge(text, "allocator_retained_bytes",
+            "Bytes in empty regions kept in the region pool.",
+            stats->retained_bytes);
+    gauge(text, "allocator_dedicated_bytes",
+            "Bytes in regions dedicated to a single large block.",
+            stats->dedicated_bytes);
+    gauge(text, "allocator_regions", "Regions currently mapped.",
+            stats->regions);
+    gauge(text, "allocator_used_blocks", "Blocks in use.",
+            stats->used_blocks);
+    gauge(text, "allocator_free_blocks", "Blocks on the free lists.",
+            stats->free_blocks);
+    gauge(text, "allocator_arenas", "Arenas threads are spread across.",
+            stats->arenas);
+
+    class_series(text, "allocator_class_blocks",
+            "Used blocks per size class.", stats,
+            offsetof(struct alloc_class_stats, blocks));
+    class_series(text, "allocator_class_bytes",
+            "Bytes of used blocks per size class.", stats,
+            offsetof(struct alloc_class_stats, bytes));
+
+    counter(text, "allocator_mmap_total", "Calls to mmap().",
+            stats->mmap_count);
+    counter(text, "allocator_munmap_total", "Calls to munmap().",
+            stats->munmap_count);
+    counter(text, "allocator_region_steals_total",
+            "Regions taken from the pool instead of mapped.",
+            stats->region_steals);
+    counter(text, "allocator_remote_frees_total",
+            "Blocks freed by a thread that doesn't own their arena.",
+            stats->remote_frees);
+
+    counter(text, "allocator_lock_contentions_total",
+            "Arena lock acquisitions that had to wait.",
+            stats->lock_contentions);
+    describe(text, "allocator_lock_wait_seconds_total", "counter",
+            "Time spent waiting for arena locks.");
+    emit(text, "allocator_lock_wait_seconds_total %zu.%09zu\n",
+            stats->lock_wait_ns / 1000000000, stats->lock_wait_ns % 1000000000);
+
+    counter(text, "allocator_tcache_hits_total",
+            "Mallocs served from a thread cache.", stats->tcache_hits);
+    counter(text, "allocator_tcache_misses_total",
+            "Mallocs that fell through a thread cache to the arena.",
+            stats->tcache_misses);
+    size_t lookups = stats->tcache_hits + stats->tcache_misses;
+    size_t ppm = lookups == 0 ? 0
+        : (size_t) ((unsigned __int128) stats->tcache_hits * 1000000 / lookups);
+    describe(text, "allocator_tcache_hit_ratio", "gauge",
+            "Share of thread cache lookups that hit.");
+    emit(text, "allocator_tcache_hit_ratio %zu.%06zu\n",
+            ppm / 1000000, ppm % 1000000);
+}
+
+bool metrics_write(const char *path)
+{
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path)
+            >= (int) sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    struct metrics_text text = { 0 };
+    text.data = mmap(NULL, METRICS_BUFFER, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (text.data == MAP_FAILED) {
+        return false;
+    }
+
+    struct alloc_stats stats;
+    allocator_stats_local(&stats);
+    format_stats(&text, &stats);
+    if (text.truncated) {
+        LOGP("metrics: export truncated\n");
+    }
+
+    bool ok = false;
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1) {
+        size_t written = 0;
+        while (written < text.len) {
+            ssize_t w = write(fd, text.data + written, text.len - written);
+            if (w <= 0) {
+                break;
+            }
+            written += w;
+        }
+        ok = close(fd) == 0 && written == text.len
+            && rename(tmp_path, path) == 0;
+        if (!ok) {
+            unlink(tmp_path);
+        }
+    }
+
+    munmap(text.data, METRICS_BUFFER);
+    return ok;
+}
+
+static void *exporter_run(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&exporter.lock);
+    while (!exporter.stop) {
+        pthread_mutex_unlock(&exporter.lock);
+        if (!metrics_write(exporter.path)) {
+            LOG("metrics: could not write %s\n", exporter.path);
+        }
+        pthread_mutex_lock(&exporter.lock);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += exporter.interval;
+        while (!exporter.stop && pthread_cond_timedwait(&exporter.wake,
+                    &exporter.lock, &deadline) != ETIMEDOUT) {
+        }
+    }
+    pthread_mutex_unlock(&exporter.lock);
+    return NULL;
+}
+
+bool metrics_start(const char *path, unsigned int interval)
+{
+    if (strlen(path) >= sizeof(exporter.path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    pthread_mutex_lock(&exporter.lock);
+    if (exporter.running) {
+        pthread_mutex_unlock(&exporter.lock);
+        errno = EBUSY;
+        return false;
+    }
+    strcpy(exporter.path, path);
+    exporter.interval = interval == 0 ? METRICS_DEFAULT_INTERVAL : interval;
+    exporter.stop = false;
+    exporter.running = pthread_create(&exporter.thread, NULL, exporter_run,
+            NULL) == 0;
+    bool running = exporter.running;
+    pthread_mutex_unlock(&exporter.lock);
+    return running;
+}
+
+void metrics_stop(void)
+{
+    pthread_mutex_lock(&exporter.lock);
+    if (!exporter.running) {
+        pthread_mutex_unlock(&exporter.lock);
+        return;
+    }
+    exporter.stop = true;
+    pthread_cond_signal(&exporter.wake);
+    pthread_mutex_unlock(&exporter.lock);
+
+    pthread_join(exporter.thread, NULL);
+
+    pthread_mutex_lock(&exporter.lock);
+    exporter.running = false;
+    pthread_mutex_unlock(&exporter.lock);
+}
+
+__attribute__((constructor))
+static void metrics_from_env(void)
+{
+    const char *path = getenv("ALLOCATOR_METRICS_FILE");
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+
+    const char *interval = getenv("ALLOCATOR_METRICS_INTERVAL");
+    metrics_start(path, interval == NULL ? 0 : strtoul(interval, NULL, 10));
+}
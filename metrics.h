@@ -0,0 +1,48 @@
+/**
+ * @file
+ *
+ * Exports the allocator's statistics in the Prometheus text exposition format,
+ * for node_exporter's textfile collector:
+ *
+ *     metrics_start("/var/lib/node_exporter/app.prom", 15);
+ *
+ * Every export goes to a temporary file next to 'path' that is then renamed
+ * over it, so the collector never reads a partial file. Exports never allocate
+ * from the heap they measure: the text is built in a mapping of its own and the
+ * heap is walked on the exporting thread (see allocator_stats_local()).
+ *
+ * Setting ALLOCATOR_METRICS_FILE (and optionally ALLOCATOR_METRICS_INTERVAL,
+ * in seconds) starts the exporter when the library is loaded.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+
+/** Seconds between exports unless told otherwise */
+#define METRICS_DEFAULT_INTERVAL 15
+
+/**
+ * Writes the current statistics to 'path' once.
+ *
+ * @return false if the file couldn't be written
+ */
+bool metrics_write(const char *path);
+
+/**
+ * Starts a background thread that calls metrics_write() every 'interval'
+ * seconds (0 for METRICS_DEFAULT_INTERVAL). Creating the thread is the only
+ * point at which the exporter allocates.
+ *
+ * @return false if an exporter is already running or the thread couldn't be
+ * started
+ */
+bool metrics_start(const char *path, unsigned int interval);
+
+/**
+ * Stops the background exporter, if one is running.
+ */
+void metrics_stop(void);
+
+#endif
@@ -0,0 +1,226 @@
+/**
+ * @file
+ *
+ * perf_event_open() based instrumentation of the allocator's code paths. Each
+ * thread lazily opens its own group of user-space-only counters; reads go
+ * through a single read() of the whole group so the measurement overhead is
+ * one syscall on entry and one on exit.
+ */
+
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "perf.h"
+
+static const char *path_names[PERF_PATH_COUNT] = {
+    [PERF_PATH_TCACHE] = "tcache",
+    [PERF_PATH_REUSE] = "reuse",
+    [PERF_PATH_MMAP] = "mmap",
+    [PERF_PATH_FREE] = "free",
+};
+
+static const char *counter_names[PERF_COUNTER_COUNT] = {
+    [PERF_L1D_MISS] = "l1d_miss",
+    [PERF_LLC_MISS] = "llc_miss",
+    [PERF_DTLB_MISS] = "dtlb_miss",
+    [PERF_BRANCH_MISS] = "branch_miss",
+};
+
+const char *perf_path_name(enum perf_path path)
+{
+    return path < PERF_PATH_COUNT ? path_names[path] : "unknown";
+}
+
+const char *perf_counter_name(enum perf_counter counter)
+{
+    return counter < PERF_COUNTER_COUNT ? counter_names[counter] : "unknown";
+}
+
+#if ALLOCATOR_PERF
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define CACHE_READ_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+     | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERF_COUNTER_COUNT] = {
+    [PERF_L1D_MISS] = {
+        PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    [PERF_LLC_MISS] = {
+        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [PERF_DTLB_MISS] = {
+        PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    [PERF_BRANCH_MISS] = {
+        PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+/** Per-thread counter group, opened on first use */
+struct perf_group {
+    /** -1 until opened; stays -1 if no counter could be opened */
+    int leader;
+    bool initialized;
+    /** Number of counters in the group, their fds, and which event each is */
+    int count;
+    int fds[PERF_COUNTER_COUNT];
+    enum perf_counter which[PERF_COUNTER_COUNT];
+};
+
+static __thread struct perf_group group
+    __attribute__((tls_model("initial-exec"))) = { .leader = -1 };
+
+/* Closes each thread's group when the thread exits */
+static pthread_key_t group_key;
+static pthread_once_t group_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_bool any_opened;
+static atomic_bool warned;
+static _Atomic uint64_t path_calls[PERF_PATH_COUNT];
+static _Atomic uint64_t path_counts[PERF_PATH_COUNT][PERF_COUNTER_COUNT];
+
+static int open_event(enum perf_counter counter, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[counter].type;
+    attr.config = events[counter].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void close_group(void *arg)
+{
+    struct perf_group *closing = arg;
+    for (int i = 0; i < closing->count; ++i) {
+        close(closing->fds[i]);
+    }
+    /* Still initialized, so allocations made while the thread finishes
+     * exiting don't reopen the counters */
+    closing->leader = -1;
+    closing->count = 0;
+}
+
+static void group_key_create(void)
+{
+    pthread_key_create(&group_key, close_group);
+}
+
+static void open_group(void)
+{
+    group.initialized = true;
+
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        int fd = open_event(i, group.leader);
+        if (fd == -1) {
+            /* Not every machine (or VM) exposes every event; skip it */
+            continue;
+        }
+        if (group.leader == -1) {
+            group.leader = fd;
+        }
+        group.fds[group.count] = fd;
+        group.which[group.count++] = i;
+    }
+
+    if (group.leader == -1) {
+        if (!atomic_exchange(&warned, true)) {
+            LOGP("perf_event_open unavailable; counters disabled\n");
+        }
+        return;
+    }
+    atomic_store_explicit(&any_opened, true, memory_order_relaxed);
+
+    pthread_once(&group_key_once, group_key_create);
+    pthread_setspecific(group_key, &group);
+}
+
+static bool read_group(uint64_t values[PERF_COUNTER_COUNT])
+{
+    struct {
+        uint64_t nr;
+        uint64_t values[PERF_COUNTER_COUNT];
+    } data;
+
+    ssize_t expected = sizeof(uint64_t) * (1 + group.count);
+    if (read(group.leader, &data, sizeof(data)) != expected) {
+        return false;
+    }
+
+    for (int i = 0; i < group.count; ++i) {
+        values[group.which[i]] = data.values[i];
+    }
+    return true;
+}
+
+void perf_begin(struct perf_sample *sample)
+{
+    if (!group.initialized) {
+        open_group();
+    }
+
+    memset(sample->values, 0, sizeof(sample->values));
+    sample->valid = group.leader != -1 && read_group(sample->values);
+}
+
+void perf_end(struct perf_sample *sample, enum perf_path path)
+{
+    uint64_t end[PERF_COUNTER_COUNT] = { 0 };
+    if (!sample->valid || !read_group(end)) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&path_calls[path], 1, memory_order_relaxed);
+    for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+        atomic_fetch_add_explicit(&path_counts[path][i],
+                end[i] - sample->values[i], memory_order_relaxed);
+    }
+}
+
+bool allocator_perf_stats(struct perf_path_stats stats[PERF_PATH_COUNT])
+{
+    for (int p = 0; p < PERF_PATH_COUNT; ++p) {
+        stats[p].calls = atomic_load_explicit(&path_calls[p],
+                memory_order_relaxed);
+        for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            stats[p].counts[i] = atomic_load_explicit(&path_counts[p][i],
+                    memory_order_relaxed);
+        }
+    }
+    return atomic_load_explicit(&any_opened, memory_order_relaxed);
+}
+
+void allocator_perf_reset(void)
+{
+    for (int p = 0; p < PERF_PATH_COUNT; ++p) {
+        atomic_store_explicit(&path_calls[p], 0, memory_order_relaxed);
+        for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+            atomic_store_explicit(&path_counts[p][i], 0,
+                    memory_order_relaxed);
+        }
+    }
+}
+
+#else
+
+bool allocator_perf_stats(struct perf_path_stats stats[PERF_PATH_COUNT])
+{
+    memset(stats, 0, sizeof(struct perf_path_stats) * PERF_PATH_COUNT);
+    return false;
+}
+
+void allocator_perf_reset(void)
+{
+}
+
+#endif
@@ -0,0 +1,82 @@
+/**
+ * @file
+ *
+ * Optional hardware performance counter instrumentation of the allocator's
+ * code paths. When the library is built with ALLOCATOR_PERF=1 (make PERF=1),
+ * each malloc_impl()/free_impl() call reads a group of perf_event_open()
+ * counters on entry and exit and attributes the deltas to the path the call
+ * took. Otherwise the hooks compile away to nothing.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef ALLOCATOR_PERF
+#define ALLOCATOR_PERF 0
+#endif
+
+/** Allocator code paths that counter deltas are attributed to */
+enum perf_path {
+    /** malloc satisfied from the thread cache without taking a lock */
+    PERF_PATH_TCACHE,
+    /** malloc satisfied from the free list */
+    PERF_PATH_REUSE,
+    /** malloc that needed a new region (mapped or taken from the pool) */
+    PERF_PATH_MMAP,
+    /** free_impl() */
+    PERF_PATH_FREE,
+    PERF_PATH_COUNT,
+};
+
+/** Hardware events sampled around each call */
+enum perf_counter {
+    PERF_L1D_MISS,
+    PERF_LLC_MISS,
+    PERF_DTLB_MISS,
+    PERF_BRANCH_MISS,
+    PERF_COUNTER_COUNT,
+};
+
+/**
+ * Accumulated counter deltas for one code path. Counters the hardware (or
+ * perf_event_paranoid) doesn't allow are reported as zero.
+ */
+struct perf_path_stats {
+    uint64_t calls;
+    uint64_t counts[PERF_COUNTER_COUNT];
+};
+
+/** Counter values captured on entry to an instrumented call */
+struct perf_sample {
+    bool valid;
+    uint64_t values[PERF_COUNTER_COUNT];
+};
+
+const char *perf_path_name(enum perf_path path);
+const char *perf_counter_name(enum perf_counter counter);
+
+/**
+ * Copies the accumulated per-path counters into 'stats'.
+ *
+ * @return false if instrumentation is compiled out or counters could not be
+ * opened, in which case 'stats' is zeroed.
+ */
+bool allocator_perf_stats(struct perf_path_stats stats[PERF_PATH_COUNT]);
+void allocator_perf_reset(void);
+
+#if ALLOCATOR_PERF
+void perf_begin(struct perf_sample *sample);
+void perf_end(struct perf_sample *sample, enum perf_path path);
+#else
+static inline void perf_begin(struct perf_sample *sample) { (void) sample; }
+static inline void perf_end(struct perf_sample *sample, enum perf_path path)
+{
+    (void) sample;
+    (void) path;
+}
+#endif
+
+#endif
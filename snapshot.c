@@ -0,0 +1,371 @@
+/**
+ * @file
+ *
+ * Heap snapshots built on allocator_iterate(). Tags and allocation sites are
+ * counted in open-addressing hash tables; all snapshot memory comes straight
+ * from mmap() because the iteration holds arena locks and must not allocate.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "snapshot.h"
+
+#define TABLE_INITIAL_CAPACITY 256
+/* Blocks counted per arena lock hold while a snapshot is taken */
+#define SNAPSHOT_CHUNK_BLOCKS 4096
+
+struct snapshot_entry {
+    char name[32];
+    void *site;
+    size_t blocks;
+    size_t bytes;
+};
+
+struct snapshot_table {
+    /** Unused slots have zero blocks */
+    struct snapshot_entry *entries;
+    size_t capacity;
+    size_t count;
+    /** Set if the table couldn't grow and some blocks went uncounted */
+    bool incomplete;
+};
+
+struct heap_snapshot {
+    struct timespec taken;
+    size_t blocks;
+    size_t bytes;
+    struct alloc_class_stats classes[ALLOC_SIZE_CLASSES];
+    struct snapshot_table tags;
+    struct snapshot_table sites;
+};
+
+/** One line of a diff report */
+struct diff_row {
+    const struct snapshot_entry *entry;
+    long long blocks;
+    long long bytes;
+    size_t before_bytes;
+    size_t after_bytes;
+};
+
+static void *map_zeroed(size_t size)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static size_t hash_entry(bool by_site, const char *name, void *site)
+{
+    if (by_site) {
+        return (size_t) (((uintptr_t) site >> 4) * 0x9E3779B97F4A7C15ULL);
+    }
+
+    /* FNV-1a */
+    size_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = name; *c != '\0'; ++c) {
+        hash = (hash ^ (unsigned char) *c) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool entry_matches(bool by_site, const struct snapshot_entry *entry,
+        const char *name, void *site)
+{
+    return by_site ? entry->site == site : strcmp(entry->name, name) == 0;
+}
+
+/**
+ * Finds the slot holding the given key, or the empty slot where it belongs.
+ */
+static struct snapshot_entry *table_slot(const struct snapshot_table *table,
+        bool by_site, const char *name, void *site)
+{
+    size_t mask = table->capacity - 1;
+    size_t index = hash_entry(by_site, name, site) & mask;
+    while (table->entries[index].blocks != 0
+            && !entry_matches(by_site, &table->entries[index], name, site)) {
+        index = (index + 1) & mask;
+    }
+    return &table->entries[index];
+}
+
+static const struct snapshot_entry *table_find(
+        const struct snapshot_table *table, bool by_site,
+        const struct snapshot_entry *key)
+{
+    if (table->entries == NULL) {
+        return NULL;
+    }
+    const struct snapshot_entry *slot
+        = table_slot(table, by_site, key->name, key->site);
+    return slot->blocks != 0 ? slot : NULL;
+}
+
+static bool table_grow(struct snapshot_table *table, bool by_site)
+{
+    size_t capacity = table->capacity == 0
+        ? TABLE_INITIAL_CAPACITY : table->capacity * 2;
+    struct snapshot_entry *entries
+        = map_zeroed(capacity * sizeof(struct snapshot_entry));
+    if (entries == NULL) {
+        return false;
+    }
+
+    struct snapshot_table grown = { entries, capacity, table->count, false };
+    for (size_t i = 0; i < table->capacity; ++i) {
+        struct snapshot_entry *entry = &table->entries[i];
+        if (entry->blocks != 0) {
+            *table_slot(&grown, by_site, entry->name, entry->site) = *entry;
+        }
+    }
+
+    if (table->entries != NULL) {
+        munmap(table->entries, table->capacity * sizeof(struct snapshot_entry));
+    }
+    table->entries = entries;
+    table->capacity = capacity;
+    return true;
+}
+
+static void table_add(struct snapshot_table *table, bool by_site,
+        const char *name, void *site, size_t size)
+{
+    /* Keep the load factor under 3/4 */
+    if ((table->count + 1) * 4 > table->capacity * 3
+            && !table_grow(table, by_site)) {
+        table->incomplete = true;
+        if (table->entries == NULL || table->count + 1 >= table->capacity) {
+            return;
+        }
+    }
+
+    struct snapshot_entry *entry = table_slot(table, by_site, name, site);
+    if (entry->blocks == 0) {
+        strncpy(entry->name, by_site ? "" : name, sizeof(entry->name) - 1);
+        entry->site = by_site ? site : NULL;
+        table->count++;
+    }
+    entry->blocks++;
+    entry->bytes += size;
+}
+
+static void table_free(struct snapshot_table *table)
+{
+    if (table->entries != NULL) {
+        munmap(table->entries, table->capacity * sizeof(struct snapshot_entry));
+    }
+}
+
+static void record_block(const struct alloc_block_info *info, void *arg)
+{
+    struct heap_snapshot *snapshot = arg;
+    if (info->state != ALLOC_BLOCK_USED) {
+        return;
+    }
+
+    snapshot->blocks++;
+    snapshot->bytes += info->size;
+
+    struct alloc_class_stats *class
+        = &snapshot->classes[alloc_size_class(info->size)];
+    class->blocks++;
+    class->bytes += info->size;
+
+    table_add(&snapshot->tags, false, info->name, NULL, info->size);
+    if (info->site != NULL) {
+        table_add(&snapshot->sites, true, "", info->site, info->size);
+    }
+}
+
+struct heap_snapshot *heap_snapshot_take(void)
+{
+    struct heap_snapshot *snapshot = map_zeroed(sizeof(*snapshot));
+    if (snapshot == NULL) {
+        return NULL;
+    }
+
+    /* Start the tables off before walking: growing them mid-walk is fine, but
+     * failing to map them at all would lose every entry. */
+    table_grow(&snapshot->tags, false);
+    table_grow(&snapshot->sites, true);
+
+    clock_gettime(CLOCK_MONOTONIC, &snapshot->taken);
+    struct alloc_cursor cursor;
+    allocator_iterate_begin(&cursor);
+    while (allocator_iterate(&cursor, SNAPSHOT_CHUNK_BLOCKS, record_block,
+                snapshot) > 0) {
+    }
+    allocator_iterate_end(&cursor);
+    return snapshot;
+}
+
+void heap_snapshot_free(struct heap_snapshot *snapshot)
+{
+    if (snapshot == NULL) {
+        return;
+    }
+    table_free(&snapshot->tags);
+    table_free(&snapshot->sites);
+    munmap(snapshot, sizeof(*snapshot));
+}
+
+static int compare_rows(const void *a, const void *b)
+{
+    const struct diff_row *left = a;
+    const struct diff_row *right = b;
+    if (left->bytes != right->bytes) {
+        return left->bytes > right->bytes ? -1 : 1;
+    }
+    if (left->blocks != right->blocks) {
+        return left->blocks > right->blocks ? -1 : 1;
+    }
+    return 0;
+}
+
+static void describe_site(void *site, char *buf, size_t len)
+{
+    Dl_info info;
+    if (dladdr(site, &info) == 0) {
+        snprintf(buf, len, "%p", site);
+    } else if (info.dli_sname != NULL) {
+        snprintf(buf, len, "%p %s+0x%zx", site, info.dli_sname,
+                (size_t) ((char *) site - (char *) info.dli_saddr));
+    } else if (info.dli_fname != NULL) {
+        snprintf(buf, len, "%p %s+0x%zx", site, info.dli_fname,
+                (size_t) ((char *) site - (char *) info.dli_fbase));
+    } else {
+        snprintf(buf, len, "%p", site);
+    }
+}
+
+/**
+ * Prints the entries of one table whose counts changed between snapshots.
+ */
+static void diff_table(const struct snapshot_table *before,
+        const struct snapshot_table *after, bool by_site, FILE *out,
+        size_t limit)
+{
+    size_t max_rows = before->count + after->count;
+    if (max_rows == 0) {
+        fprintf(out, "(none)\n");
+        return;
+    }
+
+    size_t rows_size = max_rows * sizeof(struct diff_row);
+    struct diff_row *rows = map_zeroed(rows_size);
+    if (rows == NULL) {
+        fprintf(out, "(out of memory)\n");
+        return;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < after->capacity; ++i) {
+        const struct snapshot_entry *entry = &after->entries[i];
+        if (entry->blocks == 0) {
+            continue;
+        }
+        const struct snapshot_entry *old = table_find(before, by_site, entry);
+        size_t old_blocks = old != NULL ? old->blocks : 0;
+        size_t old_bytes = old != NULL ? old->bytes : 0;
+        rows[count++] = (struct diff_row) {
+            entry,
+            (long long) entry->blocks - (long long) old_blocks,
+            (long long) entry->bytes - (long long) old_bytes,
+            old_bytes,
+            entry->bytes,
+        };
+    }
+    for (size_t i = 0; i < before->capacity; ++i) {
+        const struct snapshot_entry *entry = &before->entries[i];
+        if (entry->blocks != 0 && table_find(after, by_site, entry) == NULL) {
+            rows[count++] = (struct diff_row) {
+                entry, -(long long) entry->blocks, -(long long) entry->bytes,
+                entry->bytes, 0,
+            };
+        }
+    }
+
+    qsort(rows, count, sizeof(*rows), compare_rows);
+
+    size_t printed = 0;
+    for (size_t i = 0; i < count && (limit == 0 || printed < limit); ++i) {
+        struct diff_row *row = &rows[i];
+        if (row->blocks == 0 && row->bytes == 0) {
+            continue;
+        }
+
+        char label[256];
+        if (by_site) {
+            describe_site(row->entry->site, label, sizeof(label));
+        } else {
+            snprintf(label, sizeof(label), "'%s'", row->entry->name);
+        }
+        fprintf(out, "%+12lld bytes %+9lld blocks  (%zu -> %zu)  %s\n",
+                row->bytes, row->blocks, row->before_bytes, row->after_bytes,
+                label);
+        printed++;
+    }
+    if (printed == 0) {
+        fprintf(out, "(no change)\n");
+    }
+    if (before->incomplete || after->incomplete) {
+        fprintf(out, "(incomplete: snapshot tables couldn't grow)\n");
+    }
+
+    munmap(rows, rows_size);
+}
+
+void heap_snapshot_diff(const struct heap_snapshot *before,
+        const struct heap_snapshot *after, FILE *out, size_t limit)
+{
+    double seconds = (after->taken.tv_sec - before->taken.tv_sec)
+        + (after->taken.tv_nsec - before->taken.tv_nsec) / 1e9;
+
+    fprintf(out, "-- Heap Diff (%.3f s) --\n", seconds);
+    fprintf(out, "%zu -> %zu blocks (%+lld), %zu -> %zu bytes (%+lld)\n",
+            before->blocks, after->blocks,
+            (long long) after->blocks - (long long) before->blocks,
+            before->bytes, after->bytes,
+            (long long) after->bytes - (long long) before->bytes);
+
+    fprintf(out, "\n-- By Tag --\n");
+    diff_table(&before->tags, &after->tags, false, out, limit);
+
+    fprintf(out, "\n-- By Size Class --\n");
+    bool changed = false;
+    for (int i = 0; i < ALLOC_SIZE_CLASSES; ++i) {
+        const struct alloc_class_stats *old = &before->classes[i];
+        const struct alloc_class_stats *new = &after->classes[i];
+        if (old->blocks == new->blocks && old->bytes == new->bytes) {
+            continue;
+        }
+
+        char label[64];
+        size_t lower = i == 0 ? 0 : alloc_size_class_limit(i - 1) + 1;
+        if (i == ALLOC_SIZE_CLASSES - 1) {
+            snprintf(label, sizeof(label), "[CLASS %zu+]", lower);
+        } else {
+            snprintf(label, sizeof(label), "[CLASS %zu-%zu]", lower,
+                    alloc_size_class_limit(i));
+        }
+        fprintf(out, "%+12lld bytes %+9lld blocks  (%zu -> %zu)  %s\n",
+                (long long) new->bytes - (long long) old->bytes,
+                (long long) new->blocks - (long long) old->blocks,
+                old->bytes, new->bytes, label);
+        changed = true;
+    }
+    if (!changed) {
+        fprintf(out, "(no change)\n");
+    }
+
+    fprintf(out, "\n-- By Site --\n");
+    diff_table(&before->sites, &after->sites, true, out, limit);
+}
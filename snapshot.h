@@ -0,0 +1,44 @@
+/**
+ * @file
+ *
+ * Heap snapshots and diffs for tracking down slow leaks. A snapshot counts the
+ * blocks in use and their bytes by name tag, by size class, and by allocation
+ * site (recorded for unnamed blocks allocated through the malloc() family).
+ * Diffing two snapshots taken some time apart shows what grew in between:
+ *
+ *     struct heap_snapshot *before = heap_snapshot_take();
+ *     ...
+ *     struct heap_snapshot *after = heap_snapshot_take();
+ *     heap_snapshot_diff(before, after, stdout, 20);
+ *
+ * Snapshots are mapped directly rather than allocated from the heap, so taking
+ * one doesn't change what the next one sees.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+
+#include "allocator.h"
+
+struct heap_snapshot;
+
+/**
+ * Walks the heap and records its used blocks.
+ *
+ * @return the snapshot, or NULL if it couldn't be mapped
+ */
+struct heap_snapshot *heap_snapshot_take(void);
+
+/**
+ * Writes a report of the change in used blocks and bytes from 'before' to
+ * 'after', per tag, per size class, and per allocation site, biggest growth
+ * first. Each section lists at most 'limit' entries (0 for no limit).
+ */
+void heap_snapshot_diff(const struct heap_snapshot *before,
+        const struct heap_snapshot *after, FILE *out, size_t limit);
+
+void heap_snapshot_free(struct heap_snapshot *snapshot);
+
+#endif
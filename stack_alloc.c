@@ -0,0 +1,110 @@
+/**
+ * @file
+ *
+ * Bump-pointer stack allocator. Each thread lazily takes one chunk from the
+ * main heap (large enough to get a dedicated region) and keeps its top offset
+ * in TLS, so allocation and release are a few arithmetic operations. Fallback
+ * allocations are chained through a small header so a release can free the
+ * ones made after its mark.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "allocator.h"
+#include "logger.h"
+#include "stack_alloc.h"
+
+#define STACK_ALIGNMENT 16
+
+/** Prefixed to allocations that overflowed into the main heap */
+struct stack_overflow {
+    struct stack_overflow *next;
+    size_t pad;
+};
+
+struct thread_stack {
+    char *base;
+    size_t top;
+    struct stack_overflow *overflow;
+};
+
+static __thread struct thread_stack my_stack
+    __attribute__((tls_model("initial-exec"))) = { NULL, 0, NULL };
+
+static pthread_key_t stack_key;
+static pthread_once_t stack_key_once = PTHREAD_ONCE_INIT;
+
+static void stack_destroy(void *arg)
+{
+    struct thread_stack *stack = arg;
+    stack_release((struct stack_mark) { 0, NULL });
+    free_impl(stack->base);
+    stack->base = NULL;
+}
+
+static void stack_key_create(void)
+{
+    pthread_key_create(&stack_key, stack_destroy);
+}
+
+struct stack_mark stack_mark(void)
+{
+    return (struct stack_mark) { my_stack.top, my_stack.overflow };
+}
+
+static void *overflow_alloc(size_t size)
+{
+    if (size > SIZE_MAX - sizeof(struct stack_overflow)) {
+        return NULL;
+    }
+
+    struct stack_overflow *block
+        = malloc_impl(sizeof(*block) + size, "stack overflow");
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = my_stack.overflow;
+    my_stack.overflow = block;
+    return block + 1;
+}
+
+void *stack_alloc(size_t size)
+{
+    struct thread_stack *stack = &my_stack;
+    if (stack->base == NULL) {
+        stack->base = malloc_impl(STACK_ALLOC_CHUNK, "stack");
+        if (stack->base == NULL) {
+            return overflow_alloc(size);
+        }
+        pthread_once(&stack_key_once, stack_key_create);
+        pthread_setspecific(stack_key, stack);
+    }
+
+    size_t aligned = (size + STACK_ALIGNMENT - 1)
+        & ~(size_t) (STACK_ALIGNMENT - 1);
+    if (aligned < size || aligned > STACK_ALLOC_CHUNK - stack->top) {
+        return overflow_alloc(size);
+    }
+
+    void *ptr = stack->base + stack->top;
+    stack->top += aligned;
+    return ptr;
+}
+
+void stack_release(struct stack_mark mark)
+{
+    struct thread_stack *stack = &my_stack;
+    if (mark.top > stack->top) {
+        LOG("stack_release() to mark %zu above top %zu\n", mark.top,
+                stack->top);
+        return;
+    }
+    stack->top = mark.top;
+
+    while (stack->overflow != mark.overflow && stack->overflow != NULL) {
+        struct stack_overflow *next = stack->overflow->next;
+        free_impl(stack->overflow);
+        stack->overflow = next;
+    }
+}
@@ -0,0 +1,46 @@
+/**
+ * @file
+ *
+ * Per-thread LIFO stack allocator for frame-scoped temporaries. Allocations
+ * bump a pointer through a chunk taken from the main heap, and everything
+ * allocated since a mark is released at once by resetting the pointer:
+ *
+ *     struct stack_mark mark = stack_mark();
+ *     char *tmp = stack_alloc(len);
+ *     ...
+ *     stack_release(mark);
+ *
+ * Requests that don't fit in the rest of the chunk fall back to malloc_impl()
+ * and are freed by the stack_release() that covers them.
+ */
+
+#ifndef STACK_ALLOC_H
+#define STACK_ALLOC_H
+
+#include <stddef.h>
+
+/** Size of each thread's stack chunk */
+#define STACK_ALLOC_CHUNK (256 * 1024)
+
+/** Position in the calling thread's stack to release back to */
+struct stack_mark {
+    size_t top;
+    void *overflow;
+};
+
+struct stack_mark stack_mark(void);
+
+/**
+ * Allocates 'size' bytes (16-byte aligned) on the calling thread's stack.
+ *
+ * @return NULL if neither the stack nor the fallback heap had room
+ */
+void *stack_alloc(size_t size);
+
+/**
+ * Frees everything the calling thread allocated since 'mark' was taken. Marks
+ * must be released in LIFO order and only on the thread that took them.
+ */
+void stack_release(struct stack_mark mark);
+
+#endif